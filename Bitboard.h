@@ -0,0 +1,239 @@
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITBOARD_X86 1
+#endif
+
+// 15x15 Gomoku board as one bitset per color. Rows are 16 bits apart, so the board
+// fits in four 64-bit words (256 bits, one AVX2 register) and the spare column keeps
+// shifted lines from wrapping into the next row. A run of five is found by ANDing the
+// stones with themselves shifted along a direction: 1 for horizontal, 16 for vertical,
+// 17 for the \ diagonal and 15 for the / diagonal. A Zobrist hash of the position is
+// kept up to date as stones come and go.
+class Bitboard
+{
+public:
+    static const int SIZE = 15;
+    static const int BLACK = 0;
+    static const int WHITE = 1;
+
+    Bitboard() : zobrist(0)
+    {
+        memset(stones, 0, sizeof(stones));
+    }
+
+    static bool onBoard(int row, int col)
+    {
+        return row >= 0 && row < SIZE && col >= 0 && col < SIZE;
+    }
+
+    bool isEmpty(int row, int col) const
+    {
+        int bit = index(row, col);
+        return !(testBit(stones[BLACK], bit) || testBit(stones[WHITE], bit));
+    }
+
+    // 'X' for black, 'O' for white, '.' for an empty point
+    char at(int row, int col) const
+    {
+        int bit = index(row, col);
+        if (testBit(stones[BLACK], bit))
+        {
+            return 'X';
+        }
+        return testBit(stones[WHITE], bit) ? 'O' : '.';
+    }
+
+    void place(int color, int row, int col)
+    {
+        int bit = index(row, col);
+        if (!testBit(stones[color], bit))
+        {
+            stones[color][bit >> 6] |= 1ULL << (bit & 63);
+            zobrist ^= zobristKey(color, bit);
+        }
+    }
+
+    // Same stones, same hash, whatever order they were played in
+    uint64_t hash() const { return zobrist; }
+
+    // Five or more in a row of color running through (row, col)
+    bool hasFiveThrough(int color, int row, int col) const
+    {
+        const LineMasks& masks = lineMasks();
+        int bit = index(row, col);
+        for (int d = 0; d < DIRECTIONS; d++)
+        {
+            if (hasFive(stones[color], masks.mask[d][bit], SHIFTS[d]))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static const int STRIDE = 16;
+    static const int WORDS = 4;
+    static const int DIRECTIONS = 4;
+    static constexpr int SHIFTS[DIRECTIONS] = {1, STRIDE, STRIDE + 1, STRIDE - 1};
+
+    // Per point and direction, the points within four steps of it on that line:
+    // every run of five through the point lies inside its mask
+    struct LineMasks
+    {
+        alignas(32) uint64_t mask[DIRECTIONS][SIZE * STRIDE][WORDS];
+
+        LineMasks()
+        {
+            static const int steps[DIRECTIONS][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+            memset(mask, 0, sizeof(mask));
+            for (int row = 0; row < SIZE; row++)
+            {
+                for (int col = 0; col < SIZE; col++)
+                {
+                    int bit = index(row, col);
+                    for (int d = 0; d < DIRECTIONS; d++)
+                    {
+                        for (int k = -4; k <= 4; k++)
+                        {
+                            int r = row + k * steps[d][0];
+                            int c = col + k * steps[d][1];
+                            if (onBoard(r, c))
+                            {
+                                int other = index(r, c);
+                                mask[d][bit][other >> 6] |= 1ULL << (other & 63);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    static const LineMasks& lineMasks()
+    {
+        static const LineMasks masks;
+        return masks;
+    }
+
+    // Fixed pseudo-random key per color and point (splitmix64), the same in every
+    // run so hashes can be compared across restarts
+    struct ZobristKeys
+    {
+        uint64_t key[2][SIZE * STRIDE];
+
+        ZobristKeys()
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ULL;
+            for (int color = 0; color < 2; color++)
+            {
+                for (int bit = 0; bit < SIZE * STRIDE; bit++)
+                {
+                    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                    key[color][bit] = z ^ (z >> 31);
+                }
+            }
+        }
+    };
+
+    static uint64_t zobristKey(int color, int bit)
+    {
+        static const ZobristKeys keys;
+        return keys.key[color][bit];
+    }
+
+    static int index(int row, int col)
+    {
+        return row * STRIDE + col;
+    }
+
+    static bool testBit(const uint64_t* bits, int bit)
+    {
+        return (bits[bit >> 6] >> (bit & 63)) & 1;
+    }
+
+    static bool hasFive(const uint64_t* bits, const uint64_t* mask, int shift)
+    {
+#ifdef BITBOARD_X86
+        if (hasAvx2())
+        {
+            return hasFiveAvx2(bits, mask, shift);
+        }
+#endif
+        return hasFivePortable(bits, mask, shift);
+    }
+
+    // Move every bit n places towards bit 0 across the four words, 0 < n < 64
+    static void shiftDown(const uint64_t* in, int n, uint64_t* out)
+    {
+        for (int w = 0; w < WORDS - 1; w++)
+        {
+            out[w] = (in[w] >> n) | (in[w + 1] << (64 - n));
+        }
+        out[WORDS - 1] = in[WORDS - 1] >> n;
+    }
+
+    // b & b>>s marks starts of two in a row, doing it again with 2s four in a row,
+    // and once more with s five in a row
+    static bool hasFivePortable(const uint64_t* bits, const uint64_t* mask, int shift)
+    {
+        uint64_t line[WORDS], shifted[WORDS];
+        for (int w = 0; w < WORDS; w++)
+        {
+            line[w] = bits[w] & mask[w];
+        }
+
+        const int shifts[3] = {shift, 2 * shift, shift};
+        for (int step = 0; step < 3; step++)
+        {
+            shiftDown(line, shifts[step], shifted);
+            for (int w = 0; w < WORDS; w++)
+            {
+                line[w] &= shifted[w];
+            }
+        }
+        return (line[0] | line[1] | line[2] | line[3]) != 0;
+    }
+
+#ifdef BITBOARD_X86
+    static bool hasAvx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    // The whole board in one register; each lane takes its carry from the lane above
+    __attribute__((target("avx2")))
+    static __m256i shiftDownAvx2(__m256i v, int n)
+    {
+        __m256i above = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 3, 2, 1));
+        above = _mm256_blend_epi32(above, _mm256_setzero_si256(), 0xC0);
+        return _mm256_or_si256(_mm256_srl_epi64(v, _mm_cvtsi32_si128(n)),
+                               _mm256_sll_epi64(above, _mm_cvtsi32_si128(64 - n)));
+    }
+
+    __attribute__((target("avx2")))
+    static bool hasFiveAvx2(const uint64_t* bits, const uint64_t* mask, int shift)
+    {
+        __m256i line = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bits)),
+                                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask)));
+        line = _mm256_and_si256(line, shiftDownAvx2(line, shift));
+        line = _mm256_and_si256(line, shiftDownAvx2(line, 2 * shift));
+        line = _mm256_and_si256(line, shiftDownAvx2(line, shift));
+        return !_mm256_testz_si256(line, line);
+    }
+#endif
+
+    alignas(32) uint64_t stones[2][WORDS];
+    uint64_t zobrist;
+};
+
+#endif //BITBOARD_H
@@ -0,0 +1,252 @@
+#ifndef COMMANDEXECUTOR_H
+#define COMMANDEXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that run client commands off the event loops, so a slow command
+// doesn't hold up the reads and writes of every other client on its loop. Commands
+// are queued in lanes by how much their latency matters; a worker always takes from
+// the most urgent lane that has anything, first from its own queues, then stealing
+// from the other workers'. Tasks queued from a worker stay on that worker unless
+// another one is idle. Each lane counts its queue depth and how long tasks waited.
+class CommandExecutor
+{
+public:
+    enum Lane
+    {
+        GAME,         // moves and resignations, someone's clock is running
+        INTERACTIVE,  // everything a user waits on that isn't game play
+        BULK,         // mail, shouts and other fan-out
+        LANES
+    };
+
+    static const char* laneName(int lane)
+    {
+        static const char* names[LANES] = {"game", "interactive", "bulk"};
+        return names[lane];
+    }
+
+    explicit CommandExecutor(int workerCount)
+        : workers(static_cast<size_t>(std::max(workerCount, 1))), queued(0), nextWorker(0), stopping(false)
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].reset(new Worker());
+        }
+    }
+
+    ~CommandExecutor()
+    {
+        stop();
+    }
+
+    CommandExecutor(const CommandExecutor&) = delete;
+    CommandExecutor& operator=(const CommandExecutor&) = delete;
+
+    void start()
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i]->thread = std::thread([this, i]() { run(i); });
+        }
+    }
+
+    // Run what is already queued, then end the workers
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            if (stopping)
+            {
+                return;
+            }
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+        {
+            if (worker->thread.joinable())
+            {
+                worker->thread.join();
+            }
+        }
+        printStats();
+    }
+
+    // Safe from any thread. False (and task not run) once stop() has begun; a task
+    // accepted before that still runs before the workers end.
+    bool submit(Lane lane, std::function<void()> task)
+    {
+        // Counted before the task is pushed: once it is in a queue any worker may take
+        // it and count it down
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            if (stopping)
+            {
+                return false;
+            }
+            queued++;
+        }
+        LaneStats& stats = laneStats[lane];
+        stats.submitted++;
+        uint64_t depth = ++stats.depth;
+        uint64_t deepest = stats.maxDepth.load();
+        while (depth > deepest && !stats.maxDepth.compare_exchange_weak(deepest, depth))
+        {
+        }
+
+        size_t target = currentWorker().owner == this ? currentWorker().index
+                                                       : nextWorker++ % workers.size();
+
+        Worker& worker = *workers[target];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.lanes[lane].push_back({std::move(task), Clock::now()});
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    int getWorkerCount() const { return static_cast<int>(workers.size()); }
+
+    void printStats() const
+    {
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            const LaneStats& stats = laneStats[lane];
+            uint64_t ran = stats.completed.load();
+            if (ran == 0)
+            {
+                continue;
+            }
+            std::cout << "Executor " << laneName(lane) << " lane: " << ran << " commands, queue depth max "
+                      << stats.maxDepth.load() << ", wait avg " << stats.totalWaitUs.load() / ran / 1000.0
+                      << " ms, max " << stats.maxWaitUs.load() / 1000.0 << " ms, run avg "
+                      << stats.totalRunUs.load() / ran / 1000.0 << " ms" << std::endl;
+        }
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Task
+    {
+        std::function<void()> run;
+        Clock::time_point queuedAt;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> lanes[LANES];
+        std::thread thread;
+    };
+
+    struct LaneStats
+    {
+        std::atomic<uint64_t> submitted{0};
+        std::atomic<uint64_t> completed{0};
+        std::atomic<uint64_t> depth{0};
+        std::atomic<uint64_t> maxDepth{0};
+        std::atomic<uint64_t> totalWaitUs{0};
+        std::atomic<uint64_t> maxWaitUs{0};
+        std::atomic<uint64_t> totalRunUs{0};
+    };
+
+    // Which worker of which executor the calling thread is, if any
+    struct WorkerSlot
+    {
+        CommandExecutor* owner;
+        size_t index;
+    };
+
+    static WorkerSlot& currentWorker()
+    {
+        thread_local WorkerSlot slot = {nullptr, 0};
+        return slot;
+    }
+
+    void run(size_t self)
+    {
+        currentWorker() = {this, self};
+
+        Task task;
+        int lane;
+        while (take(self, task, lane))
+        {
+            LaneStats& stats = laneStats[lane];
+            stats.depth--;
+            Clock::time_point started = Clock::now();
+            uint64_t waitUs = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(started - task.queuedAt).count());
+            stats.totalWaitUs += waitUs;
+            uint64_t longest = stats.maxWaitUs.load();
+            while (waitUs > longest && !stats.maxWaitUs.compare_exchange_weak(longest, waitUs))
+            {
+            }
+
+            task.run();
+            task.run = nullptr;
+
+            stats.totalRunUs += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count());
+            stats.completed++;
+        }
+    }
+
+    // The next task for worker self, most urgent lane first; false once stopped and
+    // nothing is left
+    bool take(size_t self, Task& task, int& lane)
+    {
+        for (;;)
+        {
+            for (lane = 0; lane < LANES; lane++)
+            {
+                for (size_t i = 0; i < workers.size(); i++)
+                {
+                    // Its own queue first, then the others in turn
+                    Worker& victim = *workers[(self + i) % workers.size()];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    std::deque<Task>& queue = victim.lanes[lane];
+                    if (!queue.empty())
+                    {
+                        task = std::move(queue.front());
+                        queue.pop_front();
+                        std::lock_guard<std::mutex> sleepLock(sleepMutex);
+                        queued--;
+                        return true;
+                    }
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            if (queued == 0 && stopping)
+            {
+                return false;
+            }
+            wake.wait(lock, [this]() { return queued > 0 || stopping; });
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    LaneStats laneStats[LANES];
+
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    size_t queued;  // tasks in all queues, guarded by sleepMutex
+    std::atomic<size_t> nextWorker;  // where tasks from outside the pool go next
+    bool stopping;
+};
+
+#endif //COMMANDEXECUTOR_H
@@ -0,0 +1,281 @@
+#ifndef EPOLLEVENTLOOP_H
+#define EPOLLEVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+#include "EventLoop.h"
+
+// Classic readiness based backend: epoll_wait, then recv()/accept4() on ready sockets
+// and writev() of the queued output, waiting for EPOLLOUT only when a socket is full
+class EpollEventLoop : public EventLoop
+{
+public:
+    explicit EpollEventLoop(int index) : EventLoop(index), epollFd(-1), wakeFd(-1) {}
+
+    ~EpollEventLoop()
+    {
+        stop();
+        closeBackend();
+    }
+
+    const char* getBackendName() const override { return "epoll"; }
+
+protected:
+    bool openBackend() override
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0)
+        {
+            perror("epoll_create1");
+            return false;
+        }
+
+        // eventfd used to wake the loop for posted tasks and shutdown
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0 || !addWatch(wakeFd, EPOLLIN))
+        {
+            perror("eventfd");
+            closeBackend();
+            return false;
+        }
+        return true;
+    }
+
+    void closeBackend() override
+    {
+        if (wakeFd >= 0)
+        {
+            close(wakeFd);
+            wakeFd = -1;
+        }
+        if (epollFd >= 0)
+        {
+            close(epollFd);
+            epollFd = -1;
+        }
+    }
+
+    void wakeup() override
+    {
+        uint64_t one = 1;
+        ssize_t n = write(wakeFd, &one, sizeof(one));
+        (void)n;
+    }
+
+    bool watchClient(int fd) override
+    {
+        if (!addWatch(fd, EPOLLIN | EPOLLRDHUP))
+        {
+            perror("epoll_ctl add client");
+            return false;
+        }
+        return true;
+    }
+
+    void unwatchClient(int fd) override
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        waitingWritable.erase(fd);
+    }
+
+    bool watchListener(int fd) override
+    {
+        if (!addWatch(fd, EPOLLIN))
+        {
+            perror("epoll_ctl add listener");
+            return false;
+        }
+        return true;
+    }
+
+    void startFlush(int fd, OutboundChannel& channel) override
+    {
+        channel.beginFlush();
+
+        struct iovec iov[IOV_BATCH];
+        while (true)
+        {
+            int count = channel.gather(iov, IOV_BATCH);
+            if (count == 0)
+            {
+                if (waitingWritable.erase(fd))
+                {
+                    modifyWatch(fd, EPOLLIN | EPOLLRDHUP);
+                }
+                flushDone(fd);
+                return;
+            }
+
+            ssize_t written = writev(fd, iov, count);
+            syscallCount++;
+            if (written >= 0)
+            {
+                writeCount++;
+                channel.consume(written);
+                continue;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Socket buffer full, carry on when it drains
+                if (waitingWritable.insert(fd).second)
+                {
+                    modifyWatch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+                }
+                return;
+            }
+            removeClient(fd);
+            return;
+        }
+    }
+
+    void run() override
+    {
+        const int MAX_EVENTS = 64;
+        struct epoll_event events[MAX_EVENTS];
+
+        while (running)
+        {
+            int n = epoll_wait(epollFd, events, MAX_EVENTS, timerTimeoutMs());
+            syscallCount++;
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd)
+                {
+                    uint64_t count;
+                    ssize_t r = read(wakeFd, &count, sizeof(count));
+                    (void)r;
+                    syscallCount++;
+                    runPendingTasks();
+                }
+                else if (listeners.count(fd))
+                {
+                    acceptFrom(fd);
+                }
+                else if (clients.count(fd))
+                {
+                    if ((events[i].events & EPOLLOUT) && waitingWritable.count(fd))
+                    {
+                        flushClient(fd);
+                    }
+                    if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+                        clients.count(fd) && !readFrom(fd))
+                    {
+                        removeClient(fd);
+                    }
+                }
+            }
+
+            runTimers();
+            flushPending();
+        }
+    }
+
+private:
+    bool addWatch(int fd, uint32_t events)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    void modifyWatch(int fd, uint32_t events)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+        syscallCount++;
+    }
+
+    // Accept every pending connection, already non-blocking
+    void acceptFrom(int listenSocket)
+    {
+        for (int accepted = 0; accepted < 64; accepted++)
+        {
+            int clientSocket = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            syscallCount++;
+            if (clientSocket < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    perror("accept4");
+                }
+                return;
+            }
+            acceptedClient(listenSocket, clientSocket);
+        }
+    }
+
+    // Read what is available without blocking. Returns false when the connection is done.
+    bool readFrom(int fd)
+    {
+        char buffer[4096];
+
+        // Bound the reads per wakeup so one busy client can't starve the others
+        for (int reads = 0; reads < 16; reads++)
+        {
+            ssize_t nbytes = recv(fd, buffer, sizeof(buffer), 0);
+            syscallCount++;
+            if (nbytes > 0)
+            {
+                if (!deliverData(fd, buffer, nbytes))
+                {
+                    // Already removed by deliverData
+                    return true;
+                }
+                if (nbytes < static_cast<ssize_t>(sizeof(buffer)))
+                {
+                    return true;
+                }
+                continue;
+            }
+
+            if (nbytes == 0)
+            {
+                return false;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static const int IOV_BATCH = 64;  // buffers per writev
+
+    int epollFd;
+    int wakeFd;
+    std::unordered_set<int> waitingWritable;  // clients with EPOLLOUT armed
+};
+
+#endif //EPOLLEVENTLOOP_H
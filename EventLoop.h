@@ -0,0 +1,440 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "OutboundChannel.h"
+#include "Scheduler.h"
+#include "TelnetClientHandler.h"
+#include "TimingWheel.h"
+
+// One event loop thread. It owns the connections handed to it, reads from them
+// when bytes arrive and hands their commands on, so no client needs a thread of its own.
+// The I/O backend (epoll or io_uring) is provided by the subclass, which also
+// sleeps no longer than the loop's timing wheel allows.
+class EventLoop : public Scheduler
+{
+public:
+    // Called on the loop thread with each connection accepted from a listener
+    typedef std::function<void(int clientSocket)> AcceptCallback;
+
+    explicit EventLoop(int index)
+        : index(index), running(false), clientCount(0), idleTimeout(0), syscallCount(0), readCount(0),
+          writeCount(0) {}
+
+    virtual ~EventLoop() {}
+
+    bool start()
+    {
+        if (!openBackend())
+        {
+            return false;
+        }
+
+        running = true;
+        loopThread = std::thread([this]() {
+            currentSlot() = this;
+            run();
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running)
+        {
+            return;
+        }
+
+        running = false;
+        wakeup();
+
+        if (loopThread.joinable())
+        {
+            loopThread.join();
+        }
+
+        std::cout << "Event loop " << index << " (" << getBackendName() << ") stopped: "
+                  << readCount << " reads, " << writeCount << " writes, " << syscallCount << " I/O syscalls" << std::endl;
+
+        closeBackend();
+    }
+
+    // Hand a new connection to this loop. Safe to call from any thread.
+    void addClient(std::shared_ptr<TelnetClientHandler> client)
+    {
+        runInLoop([this, client]() { registerClient(client); });
+    }
+
+    // Accept connections from a listening socket on this loop
+    void addListener(int listenSocket, AcceptCallback onAccept)
+    {
+        post([this, listenSocket, onAccept]() {
+            listeners[listenSocket] = onAccept;
+            if (!watchListener(listenSocket))
+            {
+                listeners.erase(listenSocket);
+            }
+        });
+    }
+
+    // Close connections that send nothing for this long, 0 = never. Set before start().
+    void setIdleTimeout(int seconds) { idleTimeout = seconds; }
+
+    // Run a task on the loop thread
+    void post(std::function<void()> task) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            pendingTasks.push_back(std::move(task));
+        }
+        wakeup();
+    }
+
+    // Run a task now if already on the loop thread, otherwise post it
+    void runInLoop(std::function<void()> task) override
+    {
+        if (isInLoopThread())
+        {
+            task();
+        }
+        else
+        {
+            post(std::move(task));
+        }
+    }
+
+    // Write out the outbound queue of fd at the end of the current loop iteration,
+    // so everything queued until then goes out in one write. Safe from any thread.
+    void scheduleFlush(int fd)
+    {
+        runInLoop([this, fd]() { dirtyClients.push_back(fd); });
+    }
+
+    bool isInLoopThread() const override
+    {
+        return std::this_thread::get_id() == loopThread.get_id();
+    }
+
+    TimerId runAfter(TimingWheel::Clock::duration delay, std::function<void()> callback) override
+    {
+        return timers.schedule(delay, std::move(callback));
+    }
+
+    bool cancelTimer(TimerId id) override
+    {
+        return timers.cancel(id);
+    }
+
+    // Visit every connection of this loop. Only call on the loop thread.
+    void forEachClient(const std::function<void(const std::shared_ptr<TelnetClientHandler>&)>& visit)
+    {
+        for (auto& pair : clients)
+        {
+            visit(pair.second);
+        }
+    }
+
+    // Close every connection, used at shutdown once the loop thread has stopped
+    void disconnectAll()
+    {
+        for (auto& pair : clients)
+        {
+            pair.second->disconnect();
+        }
+        clients.clear();
+        clientCount = 0;
+    }
+
+    int getIndex() const { return index; }
+    int getClientCount() const { return clientCount; }
+    virtual const char* getBackendName() const = 0;
+
+protected:
+    // Backend hooks, all but wakeup() and openBackend() run on the loop thread
+    virtual bool openBackend() = 0;
+    virtual void closeBackend() = 0;
+    virtual void run() = 0;
+    virtual void wakeup() = 0;
+    virtual bool watchClient(int fd) = 0;
+    virtual void unwatchClient(int fd) = 0;
+    virtual bool watchListener(int fd) = 0;
+
+    // Start writing the queued output of a client. The backend calls flushDone()
+    // once the queue is empty, or removeClient() if the write failed.
+    virtual void startFlush(int fd, OutboundChannel& channel) = 0;
+
+    // How long the backend may wait for I/O before a timer is due, -1 = no limit
+    int timerTimeoutMs()
+    {
+        return timers.nextTimeoutMs();
+    }
+
+    // Fire the timers that are due, called by the backend after every wait
+    void runTimers()
+    {
+        timers.advance();
+    }
+
+    void runPendingTasks()
+    {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            tasks.swap(pendingTasks);
+        }
+        for (auto& task : tasks)
+        {
+            task();
+        }
+    }
+
+    void registerClient(std::shared_ptr<TelnetClientHandler> client)
+    {
+        int fd = client->getSocket();
+        if (fd < 0)
+        {
+            return;
+        }
+
+        if (!watchClient(fd))
+        {
+            client->disconnect();
+            return;
+        }
+
+        clients[fd] = client;
+        clientCount++;
+
+        std::shared_ptr<OutboundChannel> channel = client->getChannel();
+        channel->setFlushCallback([this, fd]() { scheduleFlush(fd); });
+        ChannelRegistry::getInstance().add(channel);
+
+        if (idleTimeout > 0)
+        {
+            lastActivity[fd] = TimingWheel::Clock::now();
+            armIdleTimer(fd, client, std::chrono::seconds(idleTimeout));
+        }
+
+        // The client's commands run on executor workers, which close it through the loop
+        std::weak_ptr<TelnetClientHandler> weakClient = client;
+        client->setCloseCallback([this, fd, weakClient]() {
+            runInLoop([this, fd, weakClient]() {
+                if (isCurrentClient(fd, weakClient))
+                {
+                    closeAfterFlush(fd);
+                }
+            });
+        });
+
+        client->onConnected();
+    }
+
+    void removeClient(int fd)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end())
+        {
+            return;
+        }
+
+        std::shared_ptr<TelnetClientHandler> client = it->second;
+        unwatchClient(fd);
+        clients.erase(it);
+        closingClients.erase(fd);
+        clientCount--;
+
+        auto timer = idleTimers.find(fd);
+        if (timer != idleTimers.end())
+        {
+            timers.cancel(timer->second);
+            idleTimers.erase(timer);
+        }
+        lastActivity.erase(fd);
+
+        client->disconnect();
+    }
+
+    // Pass bytes read from a connection to its handler. Returns false once the
+    // connection has been closed.
+    bool deliverData(int fd, const char* data, size_t length)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end())
+        {
+            return false;
+        }
+
+        // Input after exit is ignored while the last replies are written
+        readCount++;
+        if (closingClients.count(fd))
+        {
+            return true;
+        }
+
+        if (idleTimeout > 0)
+        {
+            // The idle timer checks this when it fires rather than being re-armed per read
+            lastActivity[fd] = TimingWheel::Clock::now();
+        }
+
+        // Keep a reference in case the client is removed while handling it
+        std::shared_ptr<TelnetClientHandler> client = it->second;
+        if (!client->onData(data, length))
+        {
+            closeAfterFlush(fd);
+            return clients.count(fd) > 0;
+        }
+        return true;
+    }
+
+    // Close a connection once what was queued for it (e.g. "Goodbye!") is written
+    void closeAfterFlush(int fd)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end())
+        {
+            return;
+        }
+
+        if (!it->second->getChannel()->hasPending())
+        {
+            removeClient(fd);
+            return;
+        }
+        closingClients.insert(fd);
+        scheduleFlush(fd);
+
+        // Don't wait forever on a client that stopped reading
+        std::weak_ptr<TelnetClientHandler> weakClient = it->second;
+        runAfter(std::chrono::seconds(CLOSE_FLUSH_SECONDS), [this, fd, weakClient]() {
+            if (isCurrentClient(fd, weakClient) && closingClients.count(fd))
+            {
+                removeClient(fd);
+            }
+        });
+    }
+
+    // Write out the clients that had output queued during this iteration
+    void flushPending()
+    {
+        std::vector<int> dirty;
+        dirty.swap(dirtyClients);
+        for (int fd : dirty)
+        {
+            flushClient(fd);
+        }
+    }
+
+    void flushClient(int fd)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end())
+        {
+            return;
+        }
+
+        OutboundChannel& channel = *it->second->getChannel();
+        if (channel.isOverflowed())
+        {
+            // Stayed too slow for too long, stop buffering for it
+            std::cerr << "Disconnecting slow client on socket " << fd << ": "
+                      << channel.getQueuedBytes() << " bytes queued" << std::endl;
+            removeClient(fd);
+            return;
+        }
+        startFlush(fd, channel);
+    }
+
+    // Called by the backend when a client's queue has been fully written. A closing
+    // client may still have a reply waiting for the disk.
+    void flushDone(int fd)
+    {
+        auto it = clients.find(fd);
+        if (closingClients.count(fd) && it != clients.end() && !it->second->getChannel()->hasPending())
+        {
+            removeClient(fd);
+        }
+    }
+
+    bool isCurrentClient(int fd, const std::weak_ptr<TelnetClientHandler>& weakClient) const
+    {
+        auto it = clients.find(fd);
+        return it != clients.end() && it->second == weakClient.lock();
+    }
+
+    // One timer per connection. It is not moved on every read: when it fires it checks
+    // the last activity and either closes the connection or sleeps for the remainder.
+    void armIdleTimer(int fd, const std::shared_ptr<TelnetClientHandler>& client, TimingWheel::Clock::duration delay)
+    {
+        std::weak_ptr<TelnetClientHandler> weakClient = client;
+        idleTimers[fd] = runAfter(delay, [this, fd, weakClient]() {
+            if (!isCurrentClient(fd, weakClient))
+            {
+                return;
+            }
+
+            TimingWheel::Clock::duration idle = TimingWheel::Clock::now() - lastActivity[fd];
+            TimingWheel::Clock::duration limit = std::chrono::seconds(idleTimeout);
+            if (idle < limit)
+            {
+                armIdleTimer(fd, clients[fd], limit - idle);
+                return;
+            }
+
+            idleTimers.erase(fd);
+            clients[fd]->sendMessage("Idle for " + std::to_string(idleTimeout) + " seconds, disconnecting.");
+            closeAfterFlush(fd);
+        });
+    }
+
+    void acceptedClient(int listenSocket, int clientSocket)
+    {
+        auto it = listeners.find(listenSocket);
+        if (it == listeners.end())
+        {
+            close(clientSocket);
+            return;
+        }
+        it->second(clientSocket);
+    }
+
+    int index;
+    std::atomic<bool> running;
+    std::atomic<int> clientCount;
+    int idleTimeout;
+    std::thread loopThread;
+
+    static constexpr int CLOSE_FLUSH_SECONDS = 5;  // longest wait to deliver the last output
+
+    // Counters for comparing backends, only written on the loop thread
+    uint64_t syscallCount;
+    uint64_t readCount;
+    uint64_t writeCount;
+
+    // Only touched on the loop thread
+    std::unordered_map<int, std::shared_ptr<TelnetClientHandler>> clients;
+    std::unordered_map<int, AcceptCallback> listeners;
+    std::vector<int> dirtyClients;  // clients with output queued this iteration
+    std::unordered_set<int> closingClients;  // closed once their output is written
+    TimingWheel timers;
+    std::unordered_map<int, TimerId> idleTimers;
+    std::unordered_map<int, TimingWheel::Clock::time_point> lastActivity;
+
+private:
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> pendingTasks;
+};
+
+#endif //EVENTLOOP_H
@@ -1,38 +1,79 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "User.h"
+#include "Scheduler.h"
+#include "Bitboard.h"
+#include "Strand.h"
+#include "StripedMap.h"
 
 enum class StoneColor { BLACK, WHITE };
 enum class GameStatus { WAITING, PLAYING, FINISHED };
 
+// A game is changed and its board read only by tasks on its strand, so moves,
+// resignations, timeouts and observers of one game take turns while other games run
+// in parallel. The players and id never change; status, turn and winner are atomic so
+// listings can read them from anywhere.
 class Game {
 private:
     int gameId;
     std::shared_ptr<User> blackPlayer;
     std::shared_ptr<User> whitePlayer;
-    std::vector<std::vector<char>> board;
-    StoneColor currentTurn;
-    GameStatus status;
-    std::string winner;
+    Bitboard board;
+    std::atomic<StoneColor> currentTurn;
+    std::atomic<GameStatus> status;
+    std::atomic<UserId> winner;
     std::vector<int> observers;
-    time_t gameStartTime;
-    time_t lastMoveTime;
+    // Clocks run on the monotonic clock so wall-clock changes don't touch them
+    std::chrono::steady_clock::time_point gameStartTime;
+    std::chrono::steady_clock::time_point lastMoveTime;
     int timeLimit;
-    int blackTimeUsed;
-    int whiteTimeUsed;
+    int moveCount;
+    long blackTimeUsedMs;
+    long whiteTimeUsedMs;
+
+    // Bumped whenever the board text changes; the text is rendered once per version
+    // and the same buffer goes to every viewer until the next move
+    uint64_t version;
+    mutable std::shared_ptr<const std::string> frame;
+    mutable uint64_t frameVersion;
+
+    // Loop that runs this game's timers, and the pending clock deadline on it
+    Scheduler* owner;
+    Scheduler::TimerId clockTimer;
+
+    Strand strand;
+
+    long elapsedSinceLastMoveMs() const {
+        return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - lastMoveTime).count());
+    }
+
+    void boardChanged() {
+        version++;
+    }
+
+    std::string renderBoard() const;
 
 public:
-    Game(int id, std::shared_ptr<User> black, std::shared_ptr<User> white, int timeLimit = 600)
+    // Delta clients get the full board again every this many moves
+    static const int KEYFRAME_INTERVAL = 16;
+
+    Game(int id, std::shared_ptr<User> black, std::shared_ptr<User> white, int timeLimit = 600,
+         Scheduler* scheduler = nullptr)
         : gameId(id), blackPlayer(black), whitePlayer(white),
-          currentTurn(StoneColor::BLACK), status(GameStatus::PLAYING),
-          timeLimit(timeLimit), blackTimeUsed(0), whiteTimeUsed(0)
+          currentTurn(StoneColor::BLACK), status(GameStatus::PLAYING), winner(UserIds::NONE),
+          timeLimit(timeLimit), moveCount(0), blackTimeUsedMs(0), whiteTimeUsedMs(0),
+          version(0), frameVersion(0), owner(scheduler), clockTimer(0)
     {
-        // Initialize empty board (15x15)
-        board.resize(15, std::vector<char>(15, '.'));
-
         // Set players' game status
         blackPlayer->setPlaying(true);
         blackPlayer->setGameId(gameId);
@@ -40,7 +81,7 @@ public:
         whitePlayer->setGameId(gameId);
 
         // Record game start time
-        gameStartTime = time(nullptr);
+        gameStartTime = std::chrono::steady_clock::now();
         lastMoveTime = gameStartTime;
 
     }
@@ -52,7 +93,7 @@ public:
     bool makeMove(std::shared_ptr<User> player, int row, int col);
     bool checkWin(int row, int col);
     void resign(std::shared_ptr<User> player);
-    void endGame(const std::string& winnerName);
+    void endGame(UserId winnerId);
 
     // Observer methods
     void addObserver(int socket);
@@ -63,20 +104,35 @@ public:
 
     // Getters
     int getId() const { return gameId; }
-    std::string getBoardString() const;
+    // The board text as a shared buffer, ready to queue for any number of clients
+    std::shared_ptr<const std::string> getBoardFrame() const;
     GameStatus getStatus() const { return status; }
     StoneColor getCurrentTurn() const { return currentTurn; }
-    std::string getWinner() const { return winner; }
+    std::string getWinner() const { return UserIds::getInstance().name(winner); }
     std::shared_ptr<User> getBlackPlayer() const { return blackPlayer; }
     std::shared_ptr<User> getWhitePlayer() const { return whitePlayer; }
+
+    // One-line event for the stone at (row, col), sent to delta clients instead of the board
+    std::string getMoveEvent(int row, int col) const;
+    bool isKeyframe() const { return moveCount % KEYFRAME_INTERVAL == 0; }
+
+    // Time the player to move has left before their flag falls
+    long getRemainingMs() const;
+
+    // Where everything that changes the game or reads its board runs
+    Strand& getStrand() { return strand; }
+
+    // Timer state, touched only on the owner loop
+    Scheduler* getOwner() const { return owner; }
+    Scheduler::TimerId getClockTimer() const { return clockTimer; }
+    void setClockTimer(Scheduler::TimerId timer) { clockTimer = timer; }
 };
 
 // GameManager to manage all games
 class GameManager {
 private:
-    std::unordered_map<int, std::shared_ptr<Game>> games;
-    int nextGameId;
-    std::mutex gamesMutex;
+    StripedMap<int, std::shared_ptr<Game>> games;
+    std::atomic<int> nextGameId;
 
     // Private constructor
     GameManager() : nextGameId(1) {}
@@ -88,12 +144,17 @@ public:
         return instance;
     }
 
-    // Create a new game
-    int createGame(std::shared_ptr<User> blackPlayer, std::shared_ptr<User> whitePlayer, int timeLimit = 600);
+    // Create a new game, its timers run on the calling loop
+    // owner is the loop the game's clock timers are set on
+    int createGame(std::shared_ptr<User> blackPlayer, std::shared_ptr<User> whitePlayer, int timeLimit = 600,
+                   Scheduler* owner = nullptr);
 
     std::shared_ptr<Game> getGame(int gameId);
     std::vector<std::shared_ptr<Game>> getAllGames();
-    void cleanupGames();
+    void removeGame(int gameId);
+
+    // How the game map's stripes were used, for the shutdown log
+    std::string getLockStats() const { return "games: " + games.summary(); }
 };
 
 void Game::playerDisconnected(std::shared_ptr<User> player) {
@@ -102,10 +163,10 @@ void Game::playerDisconnected(std::shared_ptr<User> player) {
     }
 
     // If the black player disconnected, white wins and vice versa
-    if (player->getUsername() == blackPlayer->getUsername()) {
-        endGame(whitePlayer->getUsername());
-    } else if (player->getUsername() == whitePlayer->getUsername()) {
-        endGame(blackPlayer->getUsername());
+    if (player->getId() == blackPlayer->getId()) {
+        endGame(whitePlayer->getId());
+    } else if (player->getId() == whitePlayer->getId()) {
+        endGame(blackPlayer->getId());
     }
 }
 
@@ -116,22 +177,21 @@ bool Game::checkTimeExpired() {
     }
 
     // Calculate time since last move
-    time_t now = time(nullptr);
-    int elapsed = static_cast<int>(now - lastMoveTime);
+    long elapsed = elapsedSinceLastMoveMs();
 
     // Check current player's time
     if (currentTurn == StoneColor::BLACK) {
-        int updatedBlackTime = blackTimeUsed + elapsed;
-        if (updatedBlackTime > timeLimit) {
-            std::cout << "Black player time expired: " << updatedBlackTime << " seconds" << std::endl;
-            endGame(whitePlayer->getUsername());
+        long updatedBlackTime = blackTimeUsedMs + elapsed;
+        if (updatedBlackTime > timeLimit * 1000L) {
+            std::cout << "Black player time expired: " << updatedBlackTime / 1000 << " seconds" << std::endl;
+            endGame(whitePlayer->getId());
             return true;
         }
     } else {
-        int updatedWhiteTime = whiteTimeUsed + elapsed;
-        if (updatedWhiteTime > timeLimit) {
-            std::cout << "White player time expired: " << updatedWhiteTime << " seconds" << std::endl;
-            endGame(blackPlayer->getUsername());
+        long updatedWhiteTime = whiteTimeUsedMs + elapsed;
+        if (updatedWhiteTime > timeLimit * 1000L) {
+            std::cout << "White player time expired: " << updatedWhiteTime / 1000 << " seconds" << std::endl;
+            endGame(blackPlayer->getId());
             return true;
         }
     }
@@ -139,6 +199,12 @@ bool Game::checkTimeExpired() {
     return false;
 }
 
+long Game::getRemainingMs() const {
+    long used = (currentTurn == StoneColor::BLACK) ? blackTimeUsedMs : whiteTimeUsedMs;
+    long remaining = timeLimit * 1000L - used - elapsedSinceLastMoveMs();
+    return remaining > 0 ? remaining : 0;
+}
+
 bool Game::makeMove(std::shared_ptr<User> player, int row, int col) {
     // Check if game is already over
     if (status != GameStatus::PLAYING) {
@@ -146,8 +212,8 @@ bool Game::makeMove(std::shared_ptr<User> player, int row, int col) {
     }
 
     // Check if it's the player's turn
-    bool isBlack = (player->getUsername() == blackPlayer->getUsername());
-    bool isWhite = (player->getUsername() == whitePlayer->getUsername());
+    bool isBlack = (player->getId() == blackPlayer->getId());
+    bool isWhite = (player->getId() == whitePlayer->getId());
 
     if (!isBlack && !isWhite) {
         return false;
@@ -160,39 +226,43 @@ bool Game::makeMove(std::shared_ptr<User> player, int row, int col) {
     }
 
     // Check if position is valid and empty
-    if (row < 0 || row >= 15 || col < 0 || col >= 15 || board[row][col] != '.') {
+    if (!isPositionEmpty(row, col)) {
         return false;
     }
 
     // Update time used
-    time_t now = time(nullptr);
-    int elapsed = static_cast<int>(now - lastMoveTime);
+    auto now = std::chrono::steady_clock::now();
+    long elapsed = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(now - lastMoveTime).count());
 
     // Check for time limit
     if (currentTurn == StoneColor::BLACK) {
-        blackTimeUsed += elapsed;
-        if (blackTimeUsed > timeLimit) {
-            endGame(whitePlayer->getUsername());
+        blackTimeUsedMs += elapsed;
+        if (blackTimeUsedMs > timeLimit * 1000L) {
+            boardChanged();
+            endGame(whitePlayer->getId());
             return false;
         }
     } else {
-        whiteTimeUsed += elapsed;
-        if (whiteTimeUsed > timeLimit) {
-            endGame(blackPlayer->getUsername());
+        whiteTimeUsedMs += elapsed;
+        if (whiteTimeUsedMs > timeLimit * 1000L) {
+            boardChanged();
+            endGame(blackPlayer->getId());
             return false;
         }
     }
 
     // Place stone
-    board[row][col] = (currentTurn == StoneColor::BLACK) ? 'X' : 'O';
+    board.place(currentTurn == StoneColor::BLACK ? Bitboard::BLACK : Bitboard::WHITE, row, col);
+    moveCount++;
 
     // Check for win
     if (checkWin(row, col)) {
         if (currentTurn == StoneColor::BLACK) {
-            endGame(blackPlayer->getUsername());
+            endGame(blackPlayer->getId());
         } else {
-            endGame(whitePlayer->getUsername());
+            endGame(whitePlayer->getId());
         }
+        boardChanged();
         return true; // Move was successful, even though it ended the game
     }
 
@@ -200,53 +270,25 @@ bool Game::makeMove(std::shared_ptr<User> player, int row, int col) {
         currentTurn = (currentTurn == StoneColor::BLACK) ? StoneColor::WHITE : StoneColor::BLACK;
         lastMoveTime = now;
     }
+    boardChanged();
 
     return true;
 }
 
 // Function to check if a position is empty
 bool Game::isPositionEmpty(int row, int col) const {
-    if (row < 0 || row >= 15 || col < 0 || col >= 15) {
+    if (!Bitboard::onBoard(row, col)) {
         return false;
     }
-    return board[row][col] == '.';
+    return board.isEmpty(row, col);
 }
 
 bool Game::checkWin(int row, int col) {
-    char stone = board[row][col];
-    const int directions[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}}; // horizontal, vertical, diagonal \, diagonal /
-
-    for (int d = 0; d < 4; d++) {
-        int count = 1;
-
-        // Check in positive direction
-        for (int i = 1; i < 5; i++) {
-            int newRow = row + i * directions[d][0];
-            int newCol = col + i * directions[d][1];
-
-            if (newRow < 0 || newRow >= 15 || newCol < 0 || newCol >= 15 || board[newRow][newCol] != stone) {
-                break;
-            }
-            count++;
-        }
-
-        // Check in negative direction
-        for (int i = 1; i < 5; i++) {
-            int newRow = row - i * directions[d][0];
-            int newCol = col - i * directions[d][1];
-
-            if (newRow < 0 || newRow >= 15 || newCol < 0 || newCol >= 15 || board[newRow][newCol] != stone) {
-                break;
-            }
-            count++;
-        }
-
-        if (count >= 5) {
-            return true;
-        }
+    char stone = board.at(row, col);
+    if (stone == '.') {
+        return false;
     }
-
-    return false;
+    return board.hasFiveThrough(stone == 'X' ? Bitboard::BLACK : Bitboard::WHITE, row, col);
 }
 
 void Game::resign(std::shared_ptr<User> player) {
@@ -254,24 +296,23 @@ void Game::resign(std::shared_ptr<User> player) {
         return;
     }
 
-    if (player->getUsername() == blackPlayer->getUsername()) {
-        endGame(whitePlayer->getUsername());
-    } else if (player->getUsername() == whitePlayer->getUsername()) {
-        endGame(blackPlayer->getUsername());
+    if (player->getId() == blackPlayer->getId()) {
+        endGame(whitePlayer->getId());
+    } else if (player->getId() == whitePlayer->getId()) {
+        endGame(blackPlayer->getId());
     }
 }
 
-void Game::endGame(const std::string& winnerName) {
+void Game::endGame(UserId winnerId) {
+    // The winner is set first, a game listed as finished always has one
+    winner = winnerId;
     status = GameStatus::FINISHED;
-    winner = winnerName;
 
     // Update player stats
-    if (winner == blackPlayer->getUsername()) {
-        blackPlayer->addWin();
-        whitePlayer->addLoss();
+    if (winner == blackPlayer->getId()) {
+        UserManager::getInstance().recordGameResult(blackPlayer, whitePlayer);
     } else {
-        whitePlayer->addWin();
-        blackPlayer->addLoss();
+        UserManager::getInstance().recordGameResult(whitePlayer, blackPlayer);
     }
 
     // Reset player statuses
@@ -307,64 +348,84 @@ std::vector<int> Game::getObservers() const {
     return observers;
 }
 
-std::string Game::getBoardString() const {
-    std::string result = "   A B C D E F G H I J K L M N O\n";
+std::shared_ptr<const std::string> Game::getBoardFrame() const {
+    if (!frame || frameVersion != version) {
+        frame = std::make_shared<const std::string>(renderBoard());
+        frameVersion = version;
+    }
+    return frame;
+}
+
+// Fill each row into a fixed line instead of appending cell by cell
+std::string Game::renderBoard() const {
+    static const char header[] = "   A B C D E F G H I J K L M N O\n";
+    std::string result;
+    result.reserve(sizeof(header) + 15 * 34 + 96);
+    result.append(header, sizeof(header) - 1);
+
+    char line[40];
     for (int i = 0; i < 15; i++) {
-        result += (i < 9 ? " " : "") + std::to_string(i + 1) + " ";
+        int rowNumber = i + 1;
+        line[0] = rowNumber < 10 ? ' ' : static_cast<char>('0' + rowNumber / 10);
+        line[1] = static_cast<char>('0' + rowNumber % 10);
+        line[2] = ' ';
+        int length = 3;
         for (int j = 0; j < 15; j++) {
-            result += board[i][j];
-            result += " ";
+            line[length++] = board.at(i, j);
+            line[length++] = ' ';
         }
-        result += "\n";
+        line[length++] = '\n';
+        result.append(line, length);
     }
 
-    result += "\nCurrent turn: " + std::string(currentTurn == StoneColor::BLACK ? "Black" : "White");
-
-    result += "\nBlack time used: " + std::to_string(blackTimeUsed) + " seconds";
-    result += "\nWhite time used: " + std::to_string(whiteTimeUsed) + " seconds";
+    result += "\nCurrent turn: ";
+    result += (currentTurn == StoneColor::BLACK ? "Black" : "White");
+    result += "\nBlack time used: " + std::to_string(blackTimeUsedMs / 1000) + " seconds";
+    result += "\nWhite time used: " + std::to_string(whiteTimeUsedMs / 1000) + " seconds";
 
     return result;
 }
 
-int GameManager::createGame(std::shared_ptr<User> blackPlayer, std::shared_ptr<User> whitePlayer, int timeLimit) {
-    std::lock_guard<std::mutex> lock(gamesMutex);
+// "@move <game> <move number> <point> <B|W> <black secs used> <white secs used> <board hash>"
+std::string Game::getMoveEvent(int row, int col) const {
+    char point[16];
+    snprintf(point, sizeof(point), "%c%d", 'A' + col, row + 1);
+
+    // Low and high halves of the hash folded together, enough to catch a missed move
+    uint64_t hash = board.hash();
+    char hashText[12];
+    snprintf(hashText, sizeof(hashText), "%08x", static_cast<unsigned>((hash ^ (hash >> 32)) & 0xFFFFFFFFu));
+
+    return "@move " + std::to_string(gameId) + " " + std::to_string(moveCount) + " " + point + " " +
+           (board.at(row, col) == 'X' ? "B" : "W") + " " + std::to_string(blackTimeUsedMs / 1000) + " " +
+           std::to_string(whiteTimeUsedMs / 1000) + " " + hashText;
+}
 
+int GameManager::createGame(std::shared_ptr<User> blackPlayer, std::shared_ptr<User> whitePlayer, int timeLimit,
+                            Scheduler* owner) {
     int gameId = nextGameId++;
-    games[gameId] = std::make_shared<Game>(gameId, blackPlayer, whitePlayer, timeLimit);
+    games.assign(gameId, std::make_shared<Game>(gameId, blackPlayer, whitePlayer, timeLimit, owner));
 
     return gameId;
 }
 
 std::shared_ptr<Game> GameManager::getGame(int gameId) {
-    std::lock_guard<std::mutex> lock(gamesMutex);
-
-    auto it = games.find(gameId);
-    if (it != games.end()) {
-        return it->second;
-    }
-    return nullptr;
+    std::shared_ptr<Game> game;
+    return games.find(gameId, game) ? game : nullptr;
 }
 
+// In the order they started
 std::vector<std::shared_ptr<Game>> GameManager::getAllGames() {
-    std::lock_guard<std::mutex> lock(gamesMutex);
-
     std::vector<std::shared_ptr<Game>> result;
-    for (const auto& pair : games) {
+    for (const auto& pair : games.snapshot()) {
         result.push_back(pair.second);
     }
+    std::sort(result.begin(), result.end(),
+              [](const std::shared_ptr<Game>& a, const std::shared_ptr<Game>& b) { return a->getId() < b->getId(); });
     return result;
 }
 
-void GameManager::cleanupGames() {
-    std::lock_guard<std::mutex> lock(gamesMutex);
-
-    auto it = games.begin();
-    while (it != games.end()) {
-        if (it->second->getStatus() == GameStatus::FINISHED) {
-            it = games.erase(it);
-        } else {
-            ++it;
-        }
-    }
+void GameManager::removeGame(int gameId) {
+    games.erase(gameId);
 }
 #endif // GAME_H
\ No newline at end of file
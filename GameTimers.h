@@ -0,0 +1,133 @@
+#ifndef GAMETIMERS_H
+#define GAMETIMERS_H
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Game.h"
+#include "Scheduler.h"
+#include "SocketUtils.h"
+
+// Deadlines of a game, kept on the timing wheel of the loop that created it: one for
+// the clock of the player to move, re-armed on every move, and one that removes the
+// game some time after it ended. Called from the game's strand; the timer work is
+// posted to the owning loop in the order the strand produced it, and a deadline that
+// passes is checked back on the strand.
+class GameTimers
+{
+public:
+    // Finished games stay listed for this long before they are removed
+    static constexpr int REAP_SECONDS = 30;
+
+    // A new game, its clock starts now
+    static void started(const std::shared_ptr<Game>& game)
+    {
+        armClock(game);
+    }
+
+    // The turn changed, so the deadline belongs to the other player now
+    static void moveMade(const std::shared_ptr<Game>& game)
+    {
+        armClock(game);
+    }
+
+    // Ended by a win, resignation, disconnection or timeout
+    static void finished(const std::shared_ptr<Game>& game)
+    {
+        Scheduler* owner = game->getOwner();
+        if (!owner)
+        {
+            GameManager::getInstance().removeGame(game->getId());
+            return;
+        }
+
+        std::weak_ptr<Game> weakGame = game;
+        int gameId = game->getId();
+        owner->post([owner, weakGame, gameId]() {
+            std::shared_ptr<Game> game = weakGame.lock();
+            if (game)
+            {
+                cancelClock(owner, game);
+            }
+            owner->runAfter(std::chrono::seconds(REAP_SECONDS), [gameId]() {
+                GameManager::getInstance().removeGame(gameId);
+            });
+        });
+    }
+
+private:
+    static void armClock(const std::shared_ptr<Game>& game)
+    {
+        Scheduler* owner = game->getOwner();
+        if (!owner)
+        {
+            return;
+        }
+
+        // The clocks are read here on the strand; the flag falls once the time used is
+        // over the limit, 1ms past it
+        auto delay = std::chrono::milliseconds(game->getRemainingMs() + 1);
+        std::weak_ptr<Game> weakGame = game;
+        owner->post([owner, weakGame, delay]() {
+            std::shared_ptr<Game> game = weakGame.lock();
+            if (!game || game->getStatus() != GameStatus::PLAYING)
+            {
+                return;
+            }
+
+            cancelClock(owner, game);
+            game->setClockTimer(owner->runAfter(delay, [weakGame]() { clockExpired(weakGame); }));
+        });
+    }
+
+    static void cancelClock(Scheduler* owner, const std::shared_ptr<Game>& game)
+    {
+        if (game->getClockTimer() != 0)
+        {
+            owner->cancelTimer(game->getClockTimer());
+            game->setClockTimer(0);
+        }
+    }
+
+    static void clockExpired(const std::weak_ptr<Game>& weakGame)
+    {
+        std::shared_ptr<Game> game = weakGame.lock();
+        if (!game)
+        {
+            return;
+        }
+        game->setClockTimer(0);
+        game->getStrand().post([game]() { checkClock(game); });
+    }
+
+    // On the strand: end the game if the flag really fell
+    static void checkClock(const std::shared_ptr<Game>& game)
+    {
+        if (!game->checkTimeExpired())
+        {
+            // A move got in just before the deadline, set the new one
+            if (game->getStatus() == GameStatus::PLAYING)
+            {
+                armClock(game);
+            }
+            return;
+        }
+
+        // A game has ended due to timeout
+        std::cout << "Game " << game->getId() << " ended due to timeout" << std::endl;
+
+        // Notify players and observers, all sharing one buffer
+        std::string timeoutMsg = "Game ended: " + game->getWinner() + " wins due to timeout.";
+        std::vector<int> recipients = {game->getBlackPlayer()->getSocket(), game->getWhitePlayer()->getSocket()};
+        std::vector<int> observers = game->getObservers();
+        recipients.insert(recipients.end(), observers.begin(), observers.end());
+        SocketUtils::broadcast(recipients, SocketUtils::makeBuffer(timeoutMsg + "\r\n"));
+
+        finished(game);
+    }
+};
+
+#endif //GAMETIMERS_H
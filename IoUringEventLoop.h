@@ -0,0 +1,651 @@
+#ifndef IOURINGEVENTLOOP_H
+#define IOURINGEVENTLOOP_H
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "EventLoop.h"
+
+// Completion based backend on io_uring, talking to the kernel through the raw syscalls.
+// Listeners use multishot accept, clients use multishot recv into a provided buffer
+// ring, queued output goes out as one writev per client, and everything queued during
+// one iteration is submitted with the single io_uring_enter that also waits for the
+// next completions.
+class IoUringEventLoop : public EventLoop
+{
+public:
+    explicit IoUringEventLoop(int index)
+        : EventLoop(index), ringFd(-1), wakeFd(-1), sqRing(nullptr), cqRing(nullptr), sqes(nullptr),
+          sqRingSize(0), cqRingSize(0), sqesSize(0), sqeTail(0), bufRing(nullptr), bufTail(0),
+          nextGeneration(1), wakeValue(0), multishotAccept(true), multishotRecv(true), extArg(false) {}
+
+    ~IoUringEventLoop()
+    {
+        stop();
+        closeBackend();
+    }
+
+    const char* getBackendName() const override { return "io_uring"; }
+
+protected:
+    bool openBackend() override
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        if (ringFd < 0 && errno == EINVAL)
+        {
+            // Older kernel without COOP_TASKRUN
+            memset(&params, 0, sizeof(params));
+            ringFd = static_cast<int>(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        }
+        if (ringFd < 0)
+        {
+            perror("io_uring_setup");
+            return false;
+        }
+
+        // Lets io_uring_enter wait with a timeout, for the timing wheel
+        extArg = params.features & IORING_FEAT_EXT_ARG;
+
+        if (!mapRings(params) || !setupBufferRing())
+        {
+            closeBackend();
+            return false;
+        }
+
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (wakeFd < 0)
+        {
+            perror("eventfd");
+            closeBackend();
+            return false;
+        }
+        queueWakeRead();
+        return true;
+    }
+
+    void closeBackend() override
+    {
+        if (ringFd >= 0)
+        {
+            close(ringFd);
+            ringFd = -1;
+        }
+        if (wakeFd >= 0)
+        {
+            close(wakeFd);
+            wakeFd = -1;
+        }
+        if (sqes)
+        {
+            munmap(sqes, sqesSize);
+            sqes = nullptr;
+        }
+        if (cqRing && cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        cqRing = nullptr;
+        if (sqRing)
+        {
+            munmap(sqRing, sqRingSize);
+            sqRing = nullptr;
+        }
+        if (bufRing)
+        {
+            munmap(bufRing, BUFFER_COUNT * sizeof(struct io_uring_buf));
+            bufRing = nullptr;
+        }
+    }
+
+    void wakeup() override
+    {
+        uint64_t one = 1;
+        ssize_t n = write(wakeFd, &one, sizeof(one));
+        (void)n;
+    }
+
+    bool watchClient(int fd) override
+    {
+        connectionGeneration[fd] = nextGeneration++ & GENERATION_MASK;
+        queueRecv(fd);
+        return true;
+    }
+
+    void unwatchClient(int fd) override
+    {
+        // The pending recv holds its own reference to the socket, so it has to be
+        // cancelled for the close to take effect
+        auto it = connectionGeneration.find(fd);
+        if (it == connectionGeneration.end())
+        {
+            return;
+        }
+
+        // A write still in flight keeps its channel, and so the buffers the kernel
+        // reads from, until its completion arrives
+        auto write = writes.find(makeUserData(OP_WRITE, it->second, fd));
+        if (write != writes.end() && !write->second.inFlight)
+        {
+            writes.erase(write);
+        }
+
+        struct io_uring_sqe* sqe = getSqe();
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = makeUserData(OP_RECV, it->second, fd);
+            sqe->user_data = makeUserData(OP_CANCEL, 0, fd);
+        }
+        connectionGeneration.erase(it);
+    }
+
+    bool watchListener(int fd) override
+    {
+        queueAccept(fd);
+        return true;
+    }
+
+    void startFlush(int fd, OutboundChannel& channel) override
+    {
+        auto it = connectionGeneration.find(fd);
+        if (it == connectionGeneration.end())
+        {
+            return;
+        }
+
+        uint64_t key = makeUserData(OP_WRITE, it->second, fd);
+        PendingWrite& write = writes[key];
+        if (write.inFlight)
+        {
+            // Picked up by the completion of the current write
+            return;
+        }
+
+        channel.beginFlush();
+        int count = channel.gather(write.iov, IOV_BATCH);
+        if (count == 0)
+        {
+            writes.erase(key);
+            flushDone(fd);
+            return;
+        }
+
+        struct io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+        {
+            writes.erase(key);
+            removeClient(fd);
+            return;
+        }
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(write.iov);
+        sqe->len = count;
+        sqe->user_data = key;
+        write.inFlight = true;
+        write.channel = clients[fd]->getChannel();
+    }
+
+    void run() override
+    {
+        while (running)
+        {
+            // Submit everything queued since the last call and wait for completions,
+            // or until the next timer is due
+            int ret = enter(1, timerTimeoutMs());
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME)
+            {
+                perror("io_uring_enter");
+                break;
+            }
+            processCompletions();
+            runTimers();
+            flushPending();
+        }
+    }
+
+private:
+    enum Operation { OP_WAKE = 1, OP_ACCEPT, OP_RECV, OP_CANCEL, OP_WRITE, OP_TIMEOUT };
+
+    // One writev in flight per client; the iovecs have to stay put until it completes
+    struct PendingWrite
+    {
+        static const int MAX_IOV = 64;
+        struct iovec iov[MAX_IOV];
+        bool inFlight = false;
+        std::shared_ptr<OutboundChannel> channel;
+    };
+
+    static const unsigned RING_ENTRIES = 256;
+    static const unsigned BUFFER_COUNT = 256;  // power of two
+    static const unsigned BUFFER_SIZE = 4096;
+    static const unsigned BUFFER_GROUP = 0;
+    static const uint32_t GENERATION_MASK = 0xFFFFFF;
+    static const int IOV_BATCH = PendingWrite::MAX_IOV;
+
+    // user_data: operation in the top byte, then a 24 bit generation that tells
+    // completions for a closed socket apart from those for a reused descriptor
+    static uint64_t makeUserData(Operation op, uint32_t generation, int fd)
+    {
+        return (static_cast<uint64_t>(op) << 56) |
+               (static_cast<uint64_t>(generation & GENERATION_MASK) << 32) |
+               static_cast<uint32_t>(fd);
+    }
+
+    bool mapRings(const struct io_uring_params& params)
+    {
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+        {
+            sqRing = nullptr;
+            perror("mmap sq ring");
+            return false;
+        }
+
+        if (singleMmap)
+        {
+            cqRing = sqRing;
+        }
+        else
+        {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+            {
+                cqRing = nullptr;
+                perror("mmap cq ring");
+                return false;
+            }
+        }
+
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ringFd, IORING_OFF_SQES);
+        if (sqesPtr == MAP_FAILED)
+        {
+            perror("mmap sqes");
+            return false;
+        }
+        sqes = static_cast<struct io_uring_sqe*>(sqesPtr);
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        unsigned* sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++)
+        {
+            sqArray[i] = i;
+        }
+        sqeTail = *sqTail;
+
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Register the ring of buffers the kernel picks from for recv
+    bool setupBufferRing()
+    {
+        void* ring = mmap(nullptr, BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+        {
+            perror("mmap buffer ring");
+            return false;
+        }
+        bufRing = static_cast<struct io_uring_buf_ring*>(ring);
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+        reg.ring_entries = BUFFER_COUNT;
+        reg.bgid = BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            perror("io_uring_register PBUF_RING");
+            return false;
+        }
+
+        buffers.resize(BUFFER_COUNT * BUFFER_SIZE);
+        for (unsigned bid = 0; bid < BUFFER_COUNT; bid++)
+        {
+            recycleBuffer(bid);
+        }
+        publishBuffers();
+        return true;
+    }
+
+    void recycleBuffer(unsigned bid)
+    {
+        // Index the entries from the start of the ring rather than through bufs[]: in C++
+        // the header's flexible array helper leaves bufs 8 bytes past where the kernel reads
+        struct io_uring_buf* entries = reinterpret_cast<struct io_uring_buf*>(bufRing);
+        struct io_uring_buf* buf = &entries[bufTail & (BUFFER_COUNT - 1)];
+        buf->addr = reinterpret_cast<uint64_t>(&buffers[bid * BUFFER_SIZE]);
+        buf->len = BUFFER_SIZE;
+        buf->bid = static_cast<uint16_t>(bid);
+        bufTail++;
+    }
+
+    void publishBuffers()
+    {
+        __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+    }
+
+    struct io_uring_sqe* getSqe()
+    {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqeTail - head >= sqEntries)
+        {
+            // Ring full, push what we have to the kernel first
+            enter(0);
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (sqeTail - head >= sqEntries)
+            {
+                return nullptr;
+            }
+        }
+
+        struct io_uring_sqe* sqe = &sqes[sqeTail & sqMask];
+        sqeTail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    int enter(unsigned waitFor, int timeoutMs = -1)
+    {
+        if (waitFor && timeoutMs >= 0)
+        {
+            waitTimeout.tv_sec = timeoutMs / 1000;
+            waitTimeout.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+            if (!extArg)
+            {
+                // Older kernel: a timeout request completes and ends the wait
+                queueTimeout();
+            }
+        }
+
+        __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        syscallCount++;
+
+        if (waitFor && timeoutMs >= 0 && extArg)
+        {
+            struct io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = reinterpret_cast<uint64_t>(&waitTimeout);
+            return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+                                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+        }
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+                                        waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    }
+
+    void queueTimeout()
+    {
+        struct io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+        {
+            return;
+        }
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&waitTimeout);
+        sqe->len = 1;
+        sqe->user_data = makeUserData(OP_TIMEOUT, 0, 0);
+    }
+
+    void queueWakeRead()
+    {
+        struct io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+        {
+            return;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeValue);
+        sqe->len = sizeof(wakeValue);
+        sqe->user_data = makeUserData(OP_WAKE, 0, wakeFd);
+    }
+
+    void queueAccept(int listenSocket)
+    {
+        struct io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+        {
+            return;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenSocket;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        if (multishotAccept)
+        {
+            sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+        }
+        sqe->user_data = makeUserData(OP_ACCEPT, 0, listenSocket);
+    }
+
+    void queueRecv(int fd)
+    {
+        auto it = connectionGeneration.find(fd);
+        struct io_uring_sqe* sqe = it != connectionGeneration.end() ? getSqe() : nullptr;
+        if (!sqe)
+        {
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        if (multishotRecv)
+        {
+            sqe->ioprio |= IORING_RECV_MULTISHOT;
+        }
+        sqe->user_data = makeUserData(OP_RECV, it->second, fd);
+    }
+
+    void processCompletions()
+    {
+        unsigned head = *cqHead;
+        bool buffersReturned = false;
+
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &cqes[head & cqMask];
+            uint64_t userData = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            Operation op = static_cast<Operation>(userData >> 56);
+            uint32_t generation = static_cast<uint32_t>(userData >> 32) & GENERATION_MASK;
+            int fd = static_cast<int>(userData & 0xFFFFFFFF);
+
+            if (op == OP_WAKE)
+            {
+                runPendingTasks();
+                if (running)
+                {
+                    queueWakeRead();
+                }
+            }
+            else if (op == OP_ACCEPT)
+            {
+                handleAccept(fd, res, flags);
+            }
+            else if (op == OP_RECV)
+            {
+                handleRecv(fd, generation, res, flags);
+                buffersReturned = buffersReturned || (flags & IORING_CQE_F_BUFFER);
+            }
+            else if (op == OP_WRITE)
+            {
+                handleWrite(userData, fd, res);
+            }
+        }
+
+        if (buffersReturned)
+        {
+            publishBuffers();
+        }
+    }
+
+    void handleAccept(int listenSocket, int res, unsigned flags)
+    {
+        if (res >= 0)
+        {
+            acceptedClient(listenSocket, res);
+        }
+        else if (res == -EINVAL && multishotAccept)
+        {
+            // Kernel without multishot accept, fall back to one accept per submission
+            multishotAccept = false;
+        }
+        else if (res != -ECANCELED)
+        {
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        }
+
+        if (!(flags & IORING_CQE_F_MORE) && running && listeners.count(listenSocket))
+        {
+            queueAccept(listenSocket);
+        }
+    }
+
+    void handleRecv(int fd, uint32_t generation, int res, unsigned flags)
+    {
+        auto it = connectionGeneration.find(fd);
+        bool current = it != connectionGeneration.end() && it->second == generation;
+
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (current && res > 0 && !deliverData(fd, &buffers[bid * BUFFER_SIZE], res))
+            {
+                current = false;
+            }
+            recycleBuffer(bid);
+        }
+
+        if (!current)
+        {
+            return;
+        }
+
+        if (res == 0 || (res < 0 && res != -ENOBUFS && res != -EINVAL))
+        {
+            removeClient(fd);
+            return;
+        }
+        if (res == -EINVAL && multishotRecv)
+        {
+            // Kernel without multishot recv, fall back to one recv per submission
+            multishotRecv = false;
+        }
+
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            queueRecv(fd);
+        }
+    }
+
+    void handleWrite(uint64_t key, int fd, int res)
+    {
+        auto it = writes.find(key);
+        if (it == writes.end())
+        {
+            return;
+        }
+
+        // Completion for a connection that has been closed since
+        if (!clients.count(fd) || it->second.channel != clients[fd]->getChannel())
+        {
+            writes.erase(it);
+            return;
+        }
+
+        it->second.inFlight = false;
+        if (res < 0 && res != -EAGAIN && res != -EINTR)
+        {
+            writes.erase(it);
+            removeClient(fd);
+            return;
+        }
+        if (res > 0)
+        {
+            writeCount++;
+            it->second.channel->consume(res);
+        }
+
+        // Write whatever is left, including anything queued meanwhile
+        flushClient(fd);
+    }
+
+    int ringFd;
+    int wakeFd;
+
+    void* sqRing;
+    void* cqRing;
+    struct io_uring_sqe* sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqeTail;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* bufRing;
+    uint16_t bufTail;
+    std::vector<char> buffers;
+
+    std::unordered_map<int, uint32_t> connectionGeneration;
+    std::unordered_map<uint64_t, PendingWrite> writes;  // keyed by write user_data
+    uint32_t nextGeneration;
+    uint64_t wakeValue;
+    bool multishotAccept;
+    bool multishotRecv;
+    bool extArg;
+    struct __kernel_timespec waitTimeout;
+};
+
+#endif //IOURINGEVENTLOOP_H
@@ -0,0 +1,107 @@
+#ifndef LINEFRAMER_H
+#define LINEFRAMER_H
+
+#include <cstddef>
+#include <string>
+
+// Splits the byte stream of one connection into lines. Bytes of an unfinished line
+// are kept until the rest arrives, so a command split across reads stays whole and
+// several commands in one read are all handed out, in order.
+// A line ends with \r\n, \n or \r\0 (telnet sends a bare CR as \r\0).
+class LineFramer
+{
+public:
+    static const size_t DEFAULT_MAX_LINE = 4096;
+
+    explicit LineFramer(size_t maxLineLength = DEFAULT_MAX_LINE)
+        : maxLineLength(maxLineLength), afterCR(false), discarding(false), overlongLines(0)
+    {
+        line.reserve(64);
+    }
+
+    // Feed the bytes of one read, calling onLine(const std::string&) for every complete
+    // line without its terminator. onLine returns false to stop, e.g. after "exit",
+    // and feed() then returns false with the rest of the input dropped.
+    template <typename LineHandler>
+    bool feed(const char* data, size_t length, LineHandler onLine)
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            char c = data[i];
+
+            // Second byte of a \r\n or \r\0 pair, possibly in the next read
+            if (afterCR)
+            {
+                afterCR = false;
+                if (c == '\n' || c == '\0')
+                {
+                    start = i + 1;
+                    continue;
+                }
+            }
+
+            if (c != '\r' && c != '\n')
+            {
+                continue;
+            }
+
+            afterCR = (c == '\r');
+            append(data + start, i - start);
+            start = i + 1;
+
+            if (discarding)
+            {
+                // End of a line that was too long, it was dropped
+                discarding = false;
+                overlongLines++;
+                continue;
+            }
+
+            std::string complete;
+            complete.swap(line);
+            if (!onLine(complete))
+            {
+                return false;
+            }
+        }
+
+        append(data + start, length - start);
+        return true;
+    }
+
+    // Number of lines dropped for exceeding the maximum length since the last call
+    size_t takeOverlongLines()
+    {
+        size_t count = overlongLines;
+        overlongLines = 0;
+        return count;
+    }
+
+    size_t getMaxLineLength() const { return maxLineLength; }
+
+private:
+    void append(const char* data, size_t length)
+    {
+        if (discarding || length == 0)
+        {
+            return;
+        }
+        if (line.size() + length > maxLineLength)
+        {
+            // Don't buffer without bound, skip to the end of this line
+            discarding = true;
+            line.clear();
+            return;
+        }
+        line.append(data, length);
+    }
+
+    size_t maxLineLength;
+    std::string line;  // the unfinished line so far
+    bool afterCR;
+    bool discarding;
+    size_t overlongLines;
+};
+
+#endif //LINEFRAMER_H
@@ -0,0 +1,379 @@
+#ifndef MAILSTORE_H
+#define MAILSTORE_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Mail bodies (title and content) in append-only segment files, so only small
+// headers pointing into them need to stay in memory. New bodies go to the end of the
+// active segment; once it is past SEGMENT_BYTES a new one is started. Bodies are read
+// through a read-only mapping of their segment. Deleted bodies stay where they are
+// until the segment is compacted: its live bodies are copied to the active segment
+// and the file is removed.
+//
+// A body is [payload length][crc32 of payload][payload], the payload being the
+// message id, the title length, the title and the content.
+class MailStore
+{
+public:
+    static const size_t SEGMENT_BYTES = 16 * 1024 * 1024;
+
+    // Where a body is: segment number, byte offset and length of its record
+    struct Location
+    {
+        uint32_t segment;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    explicit MailStore(const std::string& directory) : directory(directory), active(0), activeFd(-1), activeDirty(false) {}
+
+    ~MailStore()
+    {
+        for (auto& pair : segments)
+        {
+            unmap(pair.second);
+        }
+        if (activeFd >= 0)
+        {
+            close(activeFd);
+        }
+    }
+
+    MailStore(const MailStore&) = delete;
+    MailStore& operator=(const MailStore&) = delete;
+
+    // Find the existing segments and continue appending to the newest
+    bool open()
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+        {
+            perror(("mkdir " + directory).c_str());
+            return false;
+        }
+
+        DIR* dir = opendir(directory.c_str());
+        if (!dir)
+        {
+            perror(("opendir " + directory).c_str());
+            return false;
+        }
+        while (struct dirent* entry = readdir(dir))
+        {
+            unsigned int number;
+            char extra;
+            if (sscanf(entry->d_name, "segment-%u.dat%c", &number, &extra) == 1)
+            {
+                struct stat info;
+                if (stat(segmentPath(number).c_str(), &info) == 0)
+                {
+                    segments[number].size = static_cast<size_t>(info.st_size);
+                }
+            }
+        }
+        closedir(dir);
+
+        return startSegment(segments.empty() ? 1 : segments.rbegin()->first);
+    }
+
+    // Append a body, false if it couldn't be written
+    bool append(int id, const std::string& title, const std::string& content, Location& where)
+    {
+        std::string payload;
+        putU32(payload, static_cast<uint32_t>(id));
+        putU32(payload, static_cast<uint32_t>(title.size()));
+        payload += title;
+        payload += content;
+
+        std::string frame;
+        frame.reserve(HEADER_BYTES + payload.size());
+        putU32(frame, static_cast<uint32_t>(payload.size()));
+        putU32(frame, checksum(payload.data(), payload.size()));
+        frame += payload;
+
+        std::lock_guard<std::mutex> lock(storeMutex);
+        if (activeFd < 0)
+        {
+            return false;
+        }
+        if (segments[active].size > 0 && segments[active].size + frame.size() > SEGMENT_BYTES)
+        {
+            // Seal the full segment; its bodies must be durable before anything refers to them
+            if (fdatasync(activeFd) < 0)
+            {
+                perror(("fdatasync " + segmentPath(active)).c_str());
+                return false;
+            }
+            if (!startSegment(active + 1))
+            {
+                return false;
+            }
+        }
+
+        Segment& segment = segments[active];
+        if (!writeAll(activeFd, frame))
+        {
+            perror(("write " + segmentPath(active)).c_str());
+            // Drop what part of the frame got written, later offsets count from segment.size.
+            // If that fails too, segment.size moves past the torn bytes, which stay as dead space.
+            if (ftruncate(activeFd, static_cast<off_t>(segment.size)) < 0)
+            {
+                perror(("ftruncate " + segmentPath(active)).c_str());
+                struct stat info;
+                if (fstat(activeFd, &info) == 0)
+                {
+                    segment.size = static_cast<size_t>(info.st_size);
+                }
+            }
+            return false;
+        }
+        where.segment = active;
+        where.offset = static_cast<uint32_t>(segment.size);
+        where.length = static_cast<uint32_t>(frame.size());
+        segment.size += frame.size();
+        activeDirty = true;
+        return true;
+    }
+
+    // Read the body at where. content may be null when only the title is wanted.
+    bool read(const Location& where, std::string& title, std::string* content)
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        auto it = segments.find(where.segment);
+        if (it == segments.end() || where.length < HEADER_BYTES + 8)
+        {
+            return false;
+        }
+
+        Segment& segment = it->second;
+        size_t end = size_t(where.offset) + where.length;
+        if (end > segment.mapped && !remap(where.segment, segment, end))
+        {
+            return false;
+        }
+
+        const char* frame = segment.base + where.offset;
+        uint32_t payloadLength = getU32(frame);
+        const char* payload = frame + HEADER_BYTES;
+        if (payloadLength != where.length - HEADER_BYTES || getU32(frame + 4) != checksum(payload, payloadLength))
+        {
+            std::cerr << segmentPath(where.segment) << ": damaged mail at offset " << where.offset << std::endl;
+            return false;
+        }
+
+        uint32_t titleLength = getU32(payload + 4);
+        if (titleLength > payloadLength - 8)
+        {
+            return false;
+        }
+        title.assign(payload + 8, titleLength);
+        if (content)
+        {
+            content->assign(payload + 8 + titleLength, payloadLength - 8 - titleLength);
+        }
+        return true;
+    }
+
+    // Make the bodies appended so far durable, used right before the mail log commits.
+    // Syncs run one at a time: a caller that finds the flag clean must be able to count
+    // on an earlier sync having finished, not merely started. The flag is cleared before
+    // the fdatasync so appends made during it mark the store dirty again, and set again
+    // if it fails.
+    bool sync()
+    {
+        std::lock_guard<std::mutex> syncLock(syncMutex);
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(storeMutex);
+            if (!activeDirty || activeFd < 0)
+            {
+                return true;
+            }
+            activeDirty = false;
+            fd = dup(activeFd);
+        }
+
+        bool ok = fd >= 0 && fdatasync(fd) == 0;
+        if (!ok)
+        {
+            perror(("fdatasync " + directory).c_str());
+            std::lock_guard<std::mutex> lock(storeMutex);
+            activeDirty = true;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return ok;
+    }
+
+    uint32_t getActiveSegment()
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        return active;
+    }
+
+    // Bytes in each segment, live or not
+    std::map<uint32_t, size_t> segmentSizes()
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        std::map<uint32_t, size_t> sizes;
+        for (const auto& pair : segments)
+        {
+            sizes[pair.first] = pair.second.size;
+        }
+        return sizes;
+    }
+
+    // Delete a sealed segment once nothing refers to it any more
+    void removeSegment(uint32_t number)
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        auto it = segments.find(number);
+        if (it == segments.end() || number == active)
+        {
+            return;
+        }
+        unmap(it->second);
+        segments.erase(it);
+        if (unlink(segmentPath(number).c_str()) < 0)
+        {
+            perror(("unlink " + segmentPath(number)).c_str());
+        }
+    }
+
+private:
+    static const size_t HEADER_BYTES = 8;
+
+    struct Segment
+    {
+        size_t size = 0;  // bytes in the file
+        const char* base = nullptr;
+        size_t mapped = 0;  // bytes mapped at base
+    };
+
+    std::string segmentPath(uint32_t number) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/segment-%06u.dat", number);
+        return directory + name;
+    }
+
+    // storeMutex held
+    bool startSegment(uint32_t number)
+    {
+        int fd = ::open(segmentPath(number).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            perror(("open " + segmentPath(number)).c_str());
+            return false;
+        }
+        if (activeFd >= 0)
+        {
+            close(activeFd);
+        }
+        activeFd = fd;
+        active = number;
+        activeDirty = false;
+        segments[number];
+        return true;
+    }
+
+    // Map the segment again now that it has grown past the old mapping; storeMutex held
+    bool remap(uint32_t number, Segment& segment, size_t needed)
+    {
+        if (needed > segment.size)
+        {
+            return false;
+        }
+
+        int fd = ::open(segmentPath(number).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            perror(("open " + segmentPath(number)).c_str());
+            return false;
+        }
+        void* mapped = mmap(nullptr, segment.size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            perror(("mmap " + segmentPath(number)).c_str());
+            return false;
+        }
+
+        unmap(segment);
+        segment.base = static_cast<const char*>(mapped);
+        segment.mapped = segment.size;
+        return true;
+    }
+
+    static void unmap(Segment& segment)
+    {
+        if (segment.base)
+        {
+            munmap(const_cast<char*>(segment.base), segment.mapped);
+        }
+        segment.base = nullptr;
+        segment.mapped = 0;
+    }
+
+    static void putU32(std::string& out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static uint32_t getU32(const char* data)
+    {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static uint32_t checksum(const char* data, size_t length)
+    {
+        return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(length)));
+    }
+
+    static bool writeAll(int fd, const std::string& data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    std::string directory;
+    std::mutex storeMutex;
+    std::mutex syncMutex;  // held across sync()'s fdatasync, taken before storeMutex
+    std::map<uint32_t, Segment> segments;
+    uint32_t active;
+    int activeFd;
+    bool activeDirty;  // appended to since the last sync()
+};
+
+#endif //MAILSTORE_H
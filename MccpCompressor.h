@@ -0,0 +1,115 @@
+#ifndef MCCPCOMPRESSOR_H
+#define MCCPCOMPRESSOR_H
+
+#include <zlib.h>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// zlib stream of one MCCP2 (telnet COMPRESS2) connection. The stream stays open
+// for the life of the connection so later messages reuse the dictionary built by
+// earlier ones (every board looks much like the last). Only the event loop owning
+// the connection uses it.
+class MccpCompressor
+{
+public:
+    typedef std::shared_ptr<const std::string> Buffer;
+
+    MccpCompressor() : initialized(false), finished(false), bytesIn(0), bytesOut(0), cpuNanos(0) {}
+
+    ~MccpCompressor()
+    {
+        if (initialized)
+        {
+            deflateEnd(&stream);
+        }
+    }
+
+    MccpCompressor(const MccpCompressor&) = delete;
+    MccpCompressor& operator=(const MccpCompressor&) = delete;
+
+    bool init(int level)
+    {
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit(&stream, level) != Z_OK)
+        {
+            std::cerr << "deflateInit failed" << std::endl;
+            return false;
+        }
+        initialized = true;
+        return true;
+    }
+
+    // Compress one outbound batch into a single buffer. It ends with a sync flush so
+    // the client can decode everything so far, or with the end of the stream when
+    // finish is set.
+    Buffer compress(const std::vector<Buffer>& batch, bool finish = false)
+    {
+        std::string out;
+        if (!initialized || finished)
+        {
+            return std::make_shared<const std::string>(out);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+        char chunk[16384];
+        for (size_t i = 0; i <= batch.size(); i++)
+        {
+            bool last = i == batch.size();
+            if (last)
+            {
+                stream.next_in = nullptr;
+                stream.avail_in = 0;
+            }
+            else
+            {
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(batch[i]->data()));
+                stream.avail_in = static_cast<uInt>(batch[i]->size());
+                bytesIn += batch[i]->size();
+            }
+
+            // Only the last call of a batch flushes, the rest just feed the stream
+            int flush = last ? (finish ? Z_FINISH : Z_SYNC_FLUSH) : Z_NO_FLUSH;
+            do
+            {
+                stream.next_out = reinterpret_cast<Bytef*>(chunk);
+                stream.avail_out = sizeof(chunk);
+                deflate(&stream, flush);
+                out.append(chunk, sizeof(chunk) - stream.avail_out);
+            } while (stream.avail_out == 0);
+        }
+
+        if (finish)
+        {
+            finished = true;
+        }
+        bytesOut += out.size();
+
+        struct timespec end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        cpuNanos += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+        return std::make_shared<const std::string>(out);
+    }
+
+    uint64_t getBytesIn() const { return bytesIn; }
+    uint64_t getBytesOut() const { return bytesOut; }
+    uint64_t getCpuNanos() const { return cpuNanos; }
+
+private:
+    z_stream stream;
+    bool initialized;
+    bool finished;
+
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t cpuNanos;  // thread CPU time spent in deflate
+};
+
+#endif //MCCPCOMPRESSOR_H
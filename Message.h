@@ -1,11 +1,26 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include <algorithm>
+#include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 #include <mutex>
 #include <ctime>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+
+#include "MailStore.h"
+#include "TextImport.h"
+#include "UserIds.h"
+#include "WriteAheadLog.h"
 
 class Message {
 private:
@@ -57,249 +72,607 @@ public:
 
 class MessageManager {
 private:
-    std::unordered_map<std::string, std::vector<std::shared_ptr<Message>>> userMessages;
+    // What stays in memory of a message, its title and content are read from the
+    // mail store when needed
+    struct MailHeader {
+        int id;
+        UserId sender;
+        bool read;
+        int64_t timestamp;
+        MailStore::Location body;
+        bool deleted = false;  // left as a gap until the mailbox is tidied
+    };
+    using Headers = std::vector<MailHeader>;
+
+    // A user's mail in arrival order, with an index by id and the unread count kept up
+    // to date, so no mail operation has to go through the whole mailbox. The headers
+    // are shared with the last snapshot taken, so once one refers to them they aren't
+    // changed in place; changeHeaders() copies them first.
+    struct Mailbox {
+        std::shared_ptr<Headers> headers;
+        std::unordered_map<int, size_t> slots;  // id -> index in headers
+        size_t unread = 0;
+        size_t gaps = 0;      // deleted headers still in headers
+        bool shared = false;  // a snapshot holds headers
+    };
+    static const size_t GAP_SLACK = 16;  // gaps always tolerated before tidying
+
+    // Users without mail have no mailbox
+    UserIds& ids;
+    std::unordered_map<UserId, Mailbox> userMessages;
+    std::unordered_set<UserId> changedMailboxes;  // since the last snapshot
     int nextMessageId;
     std::mutex messagesMutex;
+    std::thread autosaveThread;
+    std::atomic<bool> running;
+
+    // Every change is appended to the log; mail/index.txt is a snapshot of the headers
+    // at some point of it, rewritten only by saveMessages(). The log records refer to
+    // bodies in the store, which is synced before each commit of the log.
+    MailStore store;
+    WriteAheadLog log;
+    std::mutex snapshotMutex;  // one snapshot at a time
+
+    // The headers as of the last snapshot, guarded by snapshotMutex. Taking a new one
+    // only holds the messages lock to pick up the mailboxes changed since, so the
+    // saver can write all of them while mail keeps changing.
+    struct Snapshot {
+        uint64_t lsn = 0;
+        int nextMessageId = 1;
+        std::unordered_map<UserId, std::shared_ptr<const Headers>> mailboxes;
+        std::vector<std::string> names;  // of every UserId, for writing them out
+    };
+    Snapshot snapshot;
+
+    static constexpr double COMPACT_BELOW = 0.5;  // compact sealed segments less live than this
+
+    MessageManager()
+        : ids(UserIds::getInstance()), nextMessageId(1), running(true), store("mail"), log("messages_data.wal") {
+        store.open();
+        log.setBeforeCommit([this](bool syncing) {
+            return !syncing || store.sync();
+        });
+
+        // Load the last snapshot, then the changes made since
+        bool converted = false;
+        uint64_t snapshotLsn = loadMessages(converted);
+        {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            log.open(snapshotLsn, [this, &converted](uint64_t, const WriteAheadLog::Record& record) {
+                converted = applyRecord(record) || converted;
+            });
+        }
+        if (converted) {
+            // Mail from the old format now lives in the store, record where
+            saveMessages();
+        }
 
-    MessageManager() : nextMessageId(1) {loadMessages();}
-    ~MessageManager() {saveMessages();}
-
-public:
-
-    static MessageManager& getInstance() {
-        static MessageManager instance;
-        return instance;
+        // Snapshot in the background so the log stays short
+        autosaveThread = std::thread(&MessageManager::autosaveLoop, this);
+        autosaveThread.detach();
+    }
+    ~MessageManager() {
+        running = false;
+        saveMessages();
     }
 
-    void sendMessage(const std::string& sender, const std::string& recipient,
-                 const std::string& title, const std::string& content) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
+    void autosaveLoop() {
+        const int SAVE_INTERVAL_SECONDS = 300; // Save every 5 minutes
 
-        auto message = std::make_shared<Message>(
-            nextMessageId++, sender, recipient, title, content);
+        while (running) {
+            std::this_thread::sleep_for(std::chrono::seconds(SAVE_INTERVAL_SECONDS));
+            if (compactSegments()) {
+                continue;
+            }
+            if (log.size() > 0) {
+                std::cout << "Periodic message save..." << std::endl;
+                saveMessages();
+            }
+        }
+    }
 
-        userMessages[recipient].push_back(message);
+    // messagesMutex held for all of these
+    Mailbox* findMailbox(UserId user) {
+        auto box = userMessages.find(user);
+        return box == userMessages.end() ? nullptr : &box->second;
+    }
 
-        // Save messages
-        saveMessages();
+    // Header of messageId, null if there is none. Change it only through changeHeaders().
+    const MailHeader* findHeader(UserId user, int messageId) {
+        Mailbox* box = findMailbox(user);
+        if (!box) {
+            return nullptr;
+        }
+        auto slot = box->slots.find(messageId);
+        return slot == box->slots.end() ? nullptr : &(*box->headers)[slot->second];
     }
 
-    std::vector<std::shared_ptr<Message>> getMessages(const std::string& username) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
+    // The headers of a mailbox for changing them, copied first if a snapshot holds them
+    Headers& changeHeaders(UserId user, Mailbox& box) {
+        if (box.shared) {
+            box.headers = std::make_shared<Headers>(*box.headers);
+            box.shared = false;
+        }
+        changedMailboxes.insert(user);
+        return *box.headers;
+    }
 
-        return userMessages[username];
+    // Add a header to the end of a mailbox, ignored if its id is there already
+    void addHeader(UserId recipient, const MailHeader& header) {
+        Mailbox& box = userMessages[recipient];
+        if (!box.headers) {
+            box.headers = std::make_shared<Headers>();
+        }
+        if (!box.slots.emplace(header.id, box.headers->size()).second) {
+            return;
+        }
+        changeHeaders(recipient, box).push_back(header);
+        if (!header.read) {
+            box.unread++;
+        }
+        nextMessageId = std::max(nextMessageId, header.id + 1);
     }
 
-    std::shared_ptr<Message> getMessage(const std::string& username, int messageId) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
+    // Returns false if there is no such message or it was read already
+    bool markRead(UserId user, int messageId) {
+        Mailbox* box = findMailbox(user);
+        if (!box) {
+            return false;
+        }
+        auto slot = box->slots.find(messageId);
+        if (slot == box->slots.end() || (*box->headers)[slot->second].read) {
+            return false;
+        }
+        changeHeaders(user, *box)[slot->second].read = true;
+        box->unread--;
+        return true;
+    }
 
-        for (auto& message : userMessages[username]) {
-            if (message->getId() == messageId) {
-                return message;
+    // Leaves a gap in the headers; once gaps outnumber the messages they are squeezed
+    // out, which keeps removal constant time on average
+    bool removeHeader(UserId user, int messageId) {
+        Mailbox* box = findMailbox(user);
+        if (!box) {
+            return false;
+        }
+        auto slot = box->slots.find(messageId);
+        if (slot == box->slots.end()) {
+            return false;
+        }
+        MailHeader& header = changeHeaders(user, *box)[slot->second];
+        header.deleted = true;
+        if (!header.read) {
+            box->unread--;
+        }
+        box->slots.erase(slot);
+        box->gaps++;
+
+        if (box->slots.empty()) {
+            userMessages.erase(user);
+        } else if (box->gaps > GAP_SLACK && box->gaps > box->slots.size()) {
+            auto tidy = std::make_shared<Headers>();
+            tidy->reserve(box->slots.size());
+            for (const auto& kept : *box->headers) {
+                if (!kept.deleted) {
+                    box->slots[kept.id] = tidy->size();
+                    tidy->push_back(kept);
+                }
             }
+            box->headers = tidy;
+            box->gaps = 0;
         }
-
-        return nullptr;
+        return true;
     }
 
-    bool deleteMessage(const std::string& username, int messageId) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
+    // Store the body of a new message and add its header, messagesMutex held
+    bool addMessage(int id, UserId sender, UserId recipient, const std::string& title,
+                    const std::string& content, int64_t timestamp, bool read, MailStore::Location& body) {
+        if (!store.append(id, title, content, body)) {
+            return false;
+        }
+        addHeader(recipient, MailHeader{id, sender, read, timestamp, body});
+        return true;
+    }
 
-        auto& messages = userMessages[username];
-        for (auto it = messages.begin(); it != messages.end(); ++it) {
-            if ((*it)->getId() == messageId) {
-                messages.erase(it);
-                saveMessages(); // Save after deletion
+    // Redo one logged change, messagesMutex held. Returns true for a message in the
+    // old format, which carried its body in the log record.
+    bool applyRecord(const WriteAheadLog::Record& record) {
+        try {
+            if (record.size() == 8 && record[0] == "mail") {
+                int id = std::stoi(record[1]);
+                MailStore::Location body;
+                body.segment = static_cast<uint32_t>(std::stoul(record[5]));
+                body.offset = static_cast<uint32_t>(std::stoul(record[6]));
+                body.length = static_cast<uint32_t>(std::stoul(record[7]));
+                addHeader(ids.intern(record[3]),
+                          MailHeader{id, ids.intern(record[2]), false, std::stoll(record[4]), body});
+            }
+            else if (record.size() == 7 && record[0] == "send") {
+                MailStore::Location body;
+                addMessage(std::stoi(record[1]), ids.intern(record[2]), ids.intern(record[3]), record[4], record[6],
+                           std::stoll(record[5]), false, body);
                 return true;
             }
+            else if (record.size() == 3 && (record[0] == "read" || record[0] == "delete")) {
+                int id = std::stoi(record[2]);
+                if (record[0] == "read") {
+                    markRead(ids.intern(record[1]), id);
+                } else {
+                    removeHeader(ids.intern(record[1]), id);
+                }
+            }
+        } catch (...) {
+            std::cerr << "Bad message log record: " << record[0] << std::endl;
         }
-
         return false;
     }
 
-    int countUnreadMessages(const std::string& username) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
+    // Copy the live bodies of sealed segments that are mostly deleted mail to the active
+    // segment, snapshot the new locations, then remove the old files. The bodies are
+    // found and copied from a snapshot, without the messages lock. Returns true if it
+    // compacted anything (a snapshot was written).
+    bool compactSegments() {
+        std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+
+        std::map<uint32_t, size_t> sizes = store.segmentSizes();
+        uint32_t active = store.getActiveSegment();
+        takeSnapshot();
+
+        std::map<uint32_t, size_t> live;
+        for (const auto& box : snapshot.mailboxes) {
+            for (const auto& header : *box.second) {
+                if (!header.deleted) {
+                    live[header.body.segment] += header.body.length;
+                }
+            }
+        }
+        std::vector<uint32_t> victims;
+        for (const auto& pair : sizes) {
+            if (pair.first != active && live[pair.first] < pair.second * COMPACT_BELOW) {
+                victims.push_back(pair.first);
+            }
+        }
+        if (victims.empty()) {
+            return false;
+        }
 
-        int count = 0;
-        for (auto& message : userMessages[username]) {
-            if (!message->isRead()) {
-                count++;
+        // Mail arriving meanwhile goes to the active segment, so the snapshot has every
+        // header that points into the victims
+        struct Move {
+            UserId user;
+            int id;
+            MailStore::Location from, to;
+        };
+        std::vector<Move> moves;
+        std::string title, content;
+        for (const auto& box : snapshot.mailboxes) {
+            for (const auto& header : *box.second) {
+                if (header.deleted ||
+                    std::find(victims.begin(), victims.end(), header.body.segment) == victims.end()) {
+                    continue;
+                }
+                MailStore::Location body;
+                if (store.read(header.body, title, &content) && store.append(header.id, title, content, body)) {
+                    moves.push_back(Move{box.first, header.id, header.body, body});
+                } else {
+                    // Keep the segment rather than lose the message
+                    victims.erase(std::find(victims.begin(), victims.end(), header.body.segment));
+                }
+            }
+        }
+        {
+            // Point the headers at the copies, unless the mail was deleted meanwhile
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            for (const auto& move : moves) {
+                const MailHeader* header = findHeader(move.user, move.id);
+                if (!header || header->body.segment != move.from.segment || header->body.offset != move.from.offset) {
+                    continue;
+                }
+                Mailbox& box = userMessages[move.user];
+                changeHeaders(move.user, box)[box.slots[move.id]].body = move.to;
             }
         }
 
-        return count;
+        // The snapshot (and its sync of the store) must be on disk before the old bodies go
+        if (!saveMessagesLocked()) {
+            return true;
+        }
+        for (uint32_t segment : victims) {
+            store.removeSegment(segment);
+        }
+        std::cout << "Compacted " << victims.size() << " mail segments, " << moves.size() << " messages moved"
+                  << std::endl;
+        return true;
     }
-    void markMessageAsRead(const std::string& username, int messageId) {
-        std::lock_guard<std::mutex> lock(messagesMutex);
 
-        for (auto& message : userMessages[username]) {
-            if (message->getId() == messageId && !message->isRead()) {
-                message->markAsRead();
-                saveMessages(); // Save after marking as read
-                break;
+    // Bring snapshot up to the present. The messages lock is held only to pick up the
+    // mailboxes changed since the last one. snapshotMutex held.
+    void takeSnapshot() {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        snapshot.lsn = log.lastLsn();
+        snapshot.nextMessageId = nextMessageId;
+        for (UserId user : changedMailboxes) {
+            Mailbox* box = findMailbox(user);
+            if (!box) {
+                snapshot.mailboxes.erase(user);
+            } else {
+                snapshot.mailboxes[user] = box->headers;
+                box->shared = true;
             }
         }
+        changedMailboxes.clear();
+        ids.namesSince(snapshot.names);
     }
-    // Save all messages to a file
-    bool saveMessages() {
 
+public:
 
-        if (!messagesMutex.try_lock()) {
+    static MessageManager& getInstance() {
+        static MessageManager instance;
+        return instance;
+    }
+
+    // How changes reach the disk, see WriteAheadLog
+    void setDurability(WriteAheadLog::Durability mode, int commitWindowMs) {
+        log.setDurability(mode, commitWindowMs);
+    }
+
+    // Run done once every change made so far is durable
+    void whenDurable(std::function<void()> done) {
+        log.whenDurable(log.lastLsn(), std::move(done));
+    }
+
+    // False if the body couldn't be stored; nothing is logged then
+    bool sendMessage(UserId sender, UserId recipient, const std::string& title, const std::string& content) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+
+        int id = nextMessageId;
+        int64_t timestamp = std::time(nullptr);
+        MailStore::Location body;
+        if (!addMessage(id, sender, recipient, title, content, timestamp, false, body)) {
+            std::cerr << "Failed to store mail " << id << std::endl;
             return false;
         }
-        try {
-            // Open file for writing
-            std::ofstream file("messages_data.txt");
-            if (!file.is_open()) {
-                std::cerr << "Failed to open messages_data.txt for writing" << std::endl;
-                return false;
-            }
 
-            int messageCount = 0;
-
-            // Write each message
-            for (const auto& pair : userMessages) {
-                const std::string& recipient = pair.first;
-                const auto& messages = pair.second;
-
-                for (const auto& message : messages) {
-                    file << "MESSAGE_BEGIN\n";
-                    file << "id=" << message->getId() << "\n";
-                    file << "sender=" << message->getSender() << "\n";
-                    file << "recipient=" << message->getRecipient() << "\n";
-                    file << "title=" << message->getTitle() << "\n";
-                    file << "timestamp=" << message->getTimestamp() << "\n";
-                    file << "read=" << (message->isRead() ? "1" : "0") << "\n";
-                    file << "content_begin\n";
-                    file << message->getContent();
-                    if (!message->getContent().empty() && message->getContent().back() != '\n') {
-                        file << "\n";
-                    }
-                    file << "content_end\n";
-                    file << "MESSAGE_END\n";
-
-                    messageCount++;
-                }
+        // Save messages
+        log.append({"mail", std::to_string(id), ids.name(sender), ids.name(recipient), std::to_string(timestamp),
+                    std::to_string(body.segment), std::to_string(body.offset), std::to_string(body.length)});
+        return true;
+    }
+
+    // Call visit(const Message&) for each message of user in arrival order. Only titles
+    // are read, the content is left empty. Nothing is copied or created for a user
+    // without mail. visit runs under the messages lock and must not call back in.
+    template <typename Visit>
+    void forEachMessage(UserId user, Visit visit) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+
+        Mailbox* box = findMailbox(user);
+        if (!box) {
+            return;
+        }
+
+        std::string username = ids.name(user);
+        std::string title;
+        for (const auto& header : *box->headers) {
+            if (header.deleted) {
+                continue;
             }
+            if (!store.read(header.body, title, nullptr)) {
+                title = "(unreadable)";
+            }
+            visit(Message(header.id, ids.name(header.sender), username, title, "",
+                          static_cast<time_t>(header.timestamp), header.read));
+        }
+    }
 
-            file.flush();
-            file.close();
-            std::cout << "Message data saved successfully: " << messageCount << " messages written" << std::endl;
-            return true;
+    std::shared_ptr<Message> getMessage(UserId user, int messageId) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+
+        const MailHeader* header = findHeader(user, messageId);
+        std::string title, content;
+        if (!header || !store.read(header->body, title, &content)) {
+            return nullptr;
         }
-        catch (const std::exception& e) {
-            std::cerr << "Error saving messages: " << e.what() << std::endl;
+        return std::make_shared<Message>(header->id, ids.name(header->sender), ids.name(user), title, content,
+                                         static_cast<time_t>(header->timestamp), header->read);
+    }
+
+    bool deleteMessage(UserId user, int messageId) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+
+        // The body stays in its segment until the segment is compacted
+        if (!removeHeader(user, messageId)) {
             return false;
         }
+        log.append({"delete", ids.name(user), std::to_string(messageId)}); // Save after deletion
+        return true;
     }
 
-    // Load all messages from file
-    void loadMessages() {
+    int countUnreadMessages(UserId user) {
         std::lock_guard<std::mutex> lock(messagesMutex);
 
-        try {
-            // Try to open the file
-            std::ifstream file("messages_data.txt");
-            if (!file.is_open()) {
-                std::cout << "No message data file found." << std::endl;
-                return;
-            }
+        Mailbox* box = findMailbox(user);
+        return box ? static_cast<int>(box->unread) : 0;
+    }
+    void markMessageAsRead(UserId user, int messageId) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
 
-            std::string line;
-            int id = 0;
-            std::string sender, recipient, title, content;
-            time_t timestamp = 0;
-            bool read = false;
-            bool inContentSection = false;
-            bool inMessageSection = false;
+        if (markRead(user, messageId)) {
+            log.append({"read", ids.name(user), std::to_string(messageId)}); // Save after marking as read
+        }
+    }
 
-            int highestId = 0;
+    // Write a snapshot of all message headers and drop the log records it covers.
+    bool saveMessages() {
+        std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+        return saveMessagesLocked();
+    }
 
-            while (std::getline(file, line)) {
-                if (line == "MESSAGE_BEGIN") {
-                    inMessageSection = true;
-                    id = 0;
-                    sender = recipient = title = content = "";
-                    timestamp = 0;
-                    read = false;
-                    inContentSection = false;
+private:
+    // The file is written from a snapshot, mail keeps changing meanwhile. snapshotMutex held.
+    bool saveMessagesLocked() {
+        takeSnapshot();
+        uint64_t lsn = snapshot.lsn;
+
+        std::ostringstream file;
+        int messageCount = 0;
+        file << "lsn=" << lsn << "\n";
+        file << "next=" << snapshot.nextMessageId << "\n";
+
+        // One line per message: id sender recipient timestamp read segment offset length
+        for (const auto& pair : snapshot.mailboxes) {
+            for (const auto& header : *pair.second) {
+                if (header.deleted) {
                     continue;
                 }
-                else if (line == "MESSAGE_END") {
-                    if (inMessageSection && id > 0 && !sender.empty() && !recipient.empty()) {
-                        // Create message
-                        auto message = std::make_shared<Message>(id, sender, recipient, title, content);
+                file << header.id << ' ' << snapshot.names[header.sender] << ' ' << snapshot.names[pair.first] << ' '
+                     << header.timestamp << ' ' << (header.read ? 1 : 0) << ' ' << header.body.segment << ' '
+                     << header.body.offset << ' ' << header.body.length << "\n";
+                messageCount++;
+            }
+        }
 
-                        // Set read status and timestamp
-                        if (read) {
-                            message->markAsRead();
-                        }
+        // Bodies of the messages in the snapshot must be durable before it is
+        if (!store.sync()) {
+            std::cerr << "Failed to sync mail bodies, mail/index.txt not written" << std::endl;
+            return false;
+        }
+        if (!WriteAheadLog::replaceFile("mail/index.txt", file.str())) {
+            std::cerr << "Failed to write mail/index.txt" << std::endl;
+            return false;
+        }
+        log.truncateThrough(lsn);
 
-                        // Add to the recipient's messages
-                        userMessages[recipient].push_back(message);
+        std::cout << "Message data saved successfully: " << messageCount << " messages written" << std::endl;
+        return true;
+    }
 
-                        highestId = std::max(highestId, id);
+    // Load the header snapshot, returns the lsn of the last log record it includes.
+    // Mail in the old messages_data.txt is moved into the store once (converted is set).
+    uint64_t loadMessages(bool& converted) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        uint64_t snapshotLsn = 0;
 
-                        std::cout << "Loaded message " << id << " from " << sender << " to " << recipient << std::endl;
-                    }
-                    inMessageSection = false;
+        std::ifstream file("mail/index.txt");
+        if (file.is_open()) {
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.compare(0, 4, "lsn=") == 0) {
+                    try { snapshotLsn = std::stoull(line.substr(4)); }
+                    catch (...) { snapshotLsn = 0; }
+                    continue;
+                }
+                if (line.compare(0, 5, "next=") == 0) {
+                    try { nextMessageId = std::max(nextMessageId, std::stoi(line.substr(5))); }
+                    catch (...) {}
                     continue;
                 }
 
-                if (inMessageSection) {
-                    if (line == "content_begin") {
-                        inContentSection = true;
-                        content = "";
-                        continue;
-                    }
-                    else if (line == "content_end") {
-                        inContentSection = false;
-                        continue;
-                    }
-
-                    if (inContentSection) {
-                        content += line + "\n";
-                    }
-                    else {
-                        size_t equalPos = line.find('=');
-                        if (equalPos != std::string::npos) {
-                            std::string key = line.substr(0, equalPos);
-                            std::string value = line.substr(equalPos + 1);
-
-                            if (key == "id") {
-                                try { id = std::stoi(value); }
-                                catch (...) { id = 0; }
-                            }
-                            else if (key == "sender") sender = value;
-                            else if (key == "recipient") recipient = value;
-                            else if (key == "title") title = value;
-                            else if (key == "timestamp") {
-                                try { timestamp = std::stoll(value); }
-                                catch (...) { timestamp = 0; }
-                            }
-                            else if (key == "read") read = (value == "1");
-                        }
-                    }
+                std::istringstream fields(line);
+                MailHeader header;
+                std::string sender, recipient;
+                int read;
+                if (fields >> header.id >> sender >> recipient >> header.timestamp >> read >> header.body.segment
+                           >> header.body.offset >> header.body.length) {
+                    header.sender = ids.intern(sender);
+                    header.read = read != 0;
+                    addHeader(ids.intern(recipient), header);
                 }
             }
+        } else {
+            snapshotLsn = loadTextMessages(converted);
+        }
 
-            file.close();
+        int totalMessages = 0;
+        for (const auto& pair : userMessages) {
+            totalMessages += pair.second.slots.size();
+        }
+        std::cout << "Loaded " << totalMessages << " messages for "
+                  << userMessages.size() << " users." << std::endl;
+        return snapshotLsn;
+    }
 
-            if (highestId >= nextMessageId) {
-                nextMessageId = highestId + 1;
+    // A message as written in the old messages_data.txt
+    struct TextMessage {
+        int id = 0;
+        std::string sender, recipient, title, content;
+        int64_t timestamp = 0;
+        bool read = false;
+    };
+
+    // Read the old messages_data.txt into the store, messagesMutex held. The file is
+    // parsed in parallel pieces split at MESSAGE_BEGIN, then stored in file order.
+    uint64_t loadTextMessages(bool& converted) {
+        TextImport::MappedFile file("messages_data.txt");
+        if (!file.exists()) {
+            std::cout << "No message data file found." << std::endl;
+            return 0;
+        }
+
+        std::string_view header;
+        std::vector<std::string_view> chunks =
+            TextImport::splitChunks(file.data(), "MESSAGE_BEGIN", TextImport::workerCount(), header);
+        std::vector<TextMessage> messages = TextImport::parseParallel<TextMessage>(chunks, parseTextMessages);
+
+        for (const auto& message : messages) {
+            MailStore::Location body;
+            if (addMessage(message.id, ids.intern(message.sender), ids.intern(message.recipient), message.title,
+                           message.content, message.timestamp, message.read, body)) {
+                converted = true;
             }
+        }
+        return TextImport::headerLsn(header);
+    }
 
-            int totalMessages = 0;
-            for (const auto& pair : userMessages) {
-                totalMessages += pair.second.size();
+    // Parse the messages in one piece of messages_data.txt
+    static void parseTextMessages(std::string_view text, std::vector<TextMessage>& messages) {
+        TextMessage message;
+        bool inMessageSection = false;
+
+        while (!text.empty()) {
+            std::string_view line = TextImport::nextLine(text);
+            if (line == "MESSAGE_BEGIN") {
+                inMessageSection = true;
+                message = TextMessage();
+                continue;
+            }
+            else if (line == "MESSAGE_END") {
+                if (inMessageSection && message.id > 0 && !message.sender.empty() && !message.recipient.empty()) {
+                    messages.push_back(std::move(message));
+                }
+                inMessageSection = false;
+                continue;
             }
 
-            std::cout << "Loaded " << totalMessages << " messages for "
-                      << userMessages.size() << " users." << std::endl;
-        }
-        catch (const std::exception& e) {
-            std::cerr << "Error loading messages: " << e.what() << std::endl;
+            if (!inMessageSection) {
+                continue;
+            }
+            if (line == "content_begin") {
+                // The content is every line up to content_end, taken as one piece
+                const char* start = text.data();
+                std::string_view contentLine;
+                do {
+                    contentLine = TextImport::nextLine(text);
+                } while (contentLine != "content_end" && !text.empty());
+                const char* end = contentLine == "content_end" ? contentLine.data() : text.data();
+                message.content.assign(start, static_cast<size_t>(end - start));
+                continue;
+            }
+
+            size_t equalPos = line.find('=');
+            if (equalPos == std::string_view::npos) {
+                continue;
+            }
+            std::string_view key = line.substr(0, equalPos);
+            std::string_view value = line.substr(equalPos + 1);
+
+            if (key == "id") TextImport::parseNumber(value, message.id);
+            else if (key == "sender") message.sender.assign(value);
+            else if (key == "recipient") message.recipient.assign(value);
+            else if (key == "title") message.title.assign(value);
+            else if (key == "timestamp") TextImport::parseNumber(value, message.timestamp);
+            else if (key == "read") message.read = (value == "1");
         }
     }
 };
-#endif // MESSAGE_H
\ No newline at end of file
+#endif // MESSAGE_H
@@ -0,0 +1,445 @@
+#ifndef OUTBOUNDCHANNEL_H
+#define OUTBOUNDCHANNEL_H
+
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MccpCompressor.h"
+
+// Outbound queue of one connection. Any thread can queue a message without blocking;
+// the event loop that owns the socket drains the queue with vectored writes when the
+// socket is writable, so everything queued in one loop iteration goes out in one write.
+// Once MCCP2 is on, each such batch is compressed into one buffer before it is written.
+class OutboundChannel
+{
+public:
+    typedef std::shared_ptr<const std::string> Buffer;
+
+    // Past half the high-water mark droppable messages (chat) are discarded, past the
+    // mark itself the client is considered too slow and gets disconnected.
+    static const size_t DEFAULT_HIGH_WATER = 1024 * 1024;
+
+    OutboundChannel(int fd, size_t highWater = DEFAULT_HIGH_WATER)
+        : fd(fd), highWater(highWater), headOffset(0), queuedBytes(0), firstSlot(0), flushScheduled(false),
+          overflowed(false), closed(false), compressing(false), deltaMode(false), bytesWritten(0), writeCount(0),
+          droppedMessages(0) {}
+
+    // Set by the owning event loop, called once per batch when the first message is queued
+    void setFlushCallback(std::function<void()> callback)
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        requestFlush = callback;
+    }
+
+    bool send(const std::string& data, bool droppable = false)
+    {
+        return send(std::make_shared<const std::string>(data), droppable);
+    }
+
+    bool send(Buffer data, bool droppable = false)
+    {
+        return send(&data, 1, droppable);
+    }
+
+    // Queue a message made of several shared pieces (e.g. a header and a cached
+    // board) with nothing from other senders in between
+    bool send(const std::vector<Buffer>& parts, bool droppable = false)
+    {
+        return send(parts.data(), parts.size(), droppable);
+    }
+
+    // Keep a place for a reply that isn't ready yet (it waits for the disk). Whatever
+    // is sent after this waits behind it until fill() supplies the reply.
+    uint64_t reserve()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        held.push_back(nullptr);
+        return firstSlot + held.size() - 1;
+    }
+
+    // Any thread: put the reply in its place and release what can go out now
+    void fill(uint64_t slot, Buffer data)
+    {
+        std::function<void()> notify;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            if (slot < firstSlot || slot - firstSlot >= held.size())
+            {
+                return;
+            }
+            held[slot - firstSlot] = data;
+            queuedBytes += data->size();
+            if (queuedBytes > highWater)
+            {
+                overflowed = true;
+            }
+
+            bool released = false;
+            while (!held.empty() && held.front())
+            {
+                enqueue(held.front());
+                held.pop_front();
+                firstSlot++;
+                released = true;
+            }
+            if (released && !closed && !flushScheduled)
+            {
+                flushScheduled = true;
+                notify = requestFlush;
+            }
+        }
+
+        if (notify)
+        {
+            notify();
+        }
+    }
+
+    // Loop side: the next queued message schedules a new flush from here on
+    void beginFlush()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        flushScheduled = false;
+    }
+
+    // Loop side: queue marker (the IAC SB COMPRESS2 IAC SE that tells the client the
+    // stream starts) and compress everything queued after it. Both happen under one
+    // lock, so no other sender's output can land in between and go out plain. The
+    // marker goes ahead of replies still held, which are compressed when released.
+    bool startCompression(int level, Buffer marker)
+    {
+        std::unique_ptr<MccpCompressor> stream(new MccpCompressor());
+        if (!stream->init(level))
+        {
+            return false;
+        }
+
+        std::function<void()> notify;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            if (closed)
+            {
+                return false;
+            }
+            queue.push_back(marker);
+            queuedBytes += marker->size();
+            compressor = std::move(stream);
+            compressing = true;
+
+            if (!flushScheduled)
+            {
+                flushScheduled = true;
+                notify = requestFlush;
+            }
+        }
+
+        if (notify)
+        {
+            notify();
+        }
+        return true;
+    }
+
+    // Loop side: end the compressed stream, later messages go out plain
+    void stopCompression()
+    {
+        if (!compressor)
+        {
+            return;
+        }
+        compressPending(true);
+
+        std::lock_guard<std::mutex> lock(channelMutex);
+        compressing = false;
+        for (auto& data : uncompressed)
+        {
+            // Queued while the stream was being finished
+            queue.push_back(data);
+        }
+        uncompressed.clear();
+    }
+
+    // Loop side: describe up to maxIov pending buffers, returns how many were filled.
+    // The buffers stay valid until consumed since only the loop removes them.
+    int gather(struct iovec* iov, int maxIov)
+    {
+        compressPending(false);
+
+        std::lock_guard<std::mutex> lock(channelMutex);
+        int count = 0;
+        size_t offset = headOffset;
+        for (auto it = queue.begin(); it != queue.end() && count < maxIov; ++it)
+        {
+            iov[count].iov_base = const_cast<char*>((*it)->data() + offset);
+            iov[count].iov_len = (*it)->size() - offset;
+            offset = 0;
+            if (iov[count].iov_len > 0)
+            {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // Loop side: drop bytes that have been written
+    void consume(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        bytesWritten += bytes;
+        writeCount++;
+        queuedBytes -= bytes;
+        while (bytes > 0 && !queue.empty())
+        {
+            size_t remaining = queue.front()->size() - headOffset;
+            if (bytes < remaining)
+            {
+                headOffset += bytes;
+                return;
+            }
+            bytes -= remaining;
+            queue.pop_front();
+            headOffset = 0;
+        }
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        closed = true;
+        requestFlush = nullptr;
+    }
+
+    int getSocket() const { return fd; }
+
+    // Compression totals, null if MCCP2 was never started. Loop side only.
+    const MccpCompressor* getCompressor() const { return compressor.get(); }
+
+    // Game updates as one-line move events instead of full boards, chosen by the client
+    void setDeltaMode(bool enabled) { deltaMode = enabled; }
+    bool isDeltaMode() const { return deltaMode; }
+
+    bool hasPending()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return queuedBytes > 0 || !held.empty();
+    }
+
+    bool isOverflowed()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return overflowed;
+    }
+
+    size_t getQueuedBytes()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return queuedBytes;
+    }
+
+    size_t getBytesWritten()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return bytesWritten;
+    }
+
+    size_t getWriteCount()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return writeCount;
+    }
+
+    size_t getDroppedMessages()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        return droppedMessages;
+    }
+
+private:
+    bool send(const Buffer* parts, size_t count, bool droppable)
+    {
+        std::function<void()> notify;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            if (closed || overflowed)
+            {
+                return false;
+            }
+
+            // Degrade a slow client by dropping chat before it has to be cut off
+            if (droppable && queuedBytes > highWater / 2)
+            {
+                droppedMessages++;
+                return true;
+            }
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (held.empty())
+                {
+                    enqueue(parts[i]);
+                }
+                else
+                {
+                    held.push_back(parts[i]);
+                }
+                queuedBytes += parts[i]->size();
+            }
+            if (queuedBytes > highWater)
+            {
+                overflowed = true;
+            }
+
+            if (held.empty() && !flushScheduled)
+            {
+                flushScheduled = true;
+                notify = requestFlush;
+            }
+        }
+
+        if (notify)
+        {
+            notify();
+        }
+        return true;
+    }
+
+    // channelMutex held
+    void enqueue(const Buffer& data)
+    {
+        if (compressing)
+        {
+            uncompressed.push_back(data);
+        }
+        else
+        {
+            queue.push_back(data);
+        }
+    }
+
+    // Turn the messages queued since the last batch into one compressed buffer.
+    // deflate runs outside the lock so senders aren't held up by it.
+    void compressPending(bool finish)
+    {
+        std::vector<Buffer> batch;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            if (!compressing || (uncompressed.empty() && !finish))
+            {
+                return;
+            }
+            batch.swap(uncompressed);
+        }
+
+        Buffer compressed = compressor->compress(batch, finish);
+        size_t plainBytes = 0;
+        for (auto& data : batch)
+        {
+            plainBytes += data->size();
+        }
+
+        std::lock_guard<std::mutex> lock(channelMutex);
+        queuedBytes = queuedBytes - plainBytes + compressed->size();
+        if (!compressed->empty())
+        {
+            queue.push_back(compressed);
+        }
+    }
+
+    int fd;
+    size_t highWater;
+    std::mutex channelMutex;
+    std::deque<Buffer> queue;
+    size_t headOffset;  // bytes of queue.front() already written
+    size_t queuedBytes;
+
+    // Output waiting behind a reserved reply; a null entry is a reply not filled yet
+    std::deque<Buffer> held;
+    uint64_t firstSlot;  // slot number of held.front()
+
+    bool flushScheduled;
+    bool overflowed;
+    bool closed;
+    std::function<void()> requestFlush;
+
+    // MCCP2: while compressing, new messages wait in uncompressed until the loop
+    // compresses them as one batch. The stream itself is only used by the loop.
+    bool compressing;
+    std::vector<Buffer> uncompressed;
+    std::unique_ptr<MccpCompressor> compressor;
+
+    std::atomic<bool> deltaMode;
+
+    size_t bytesWritten;
+    size_t writeCount;
+    size_t droppedMessages;
+};
+
+// Maps sockets to the channel of the connection, so code that only knows a
+// socket (opponents, observers) can queue messages for it
+class ChannelRegistry
+{
+private:
+    std::unordered_map<int, std::shared_ptr<OutboundChannel>> channels;
+    std::mutex registryMutex;
+
+    ChannelRegistry() {}
+
+public:
+    // Get the instance
+    static ChannelRegistry& getInstance()
+    {
+        static ChannelRegistry instance;
+        return instance;
+    }
+
+    void add(const std::shared_ptr<OutboundChannel>& channel)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        channels[channel->getSocket()] = channel;
+    }
+
+    void remove(const std::shared_ptr<OutboundChannel>& channel)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto it = channels.find(channel->getSocket());
+        if (it != channels.end() && it->second == channel)
+        {
+            channels.erase(it);
+        }
+    }
+
+    std::shared_ptr<OutboundChannel> find(int sock)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto it = channels.find(sock);
+        if (it != channels.end())
+        {
+            return it->second;
+        }
+        return nullptr;
+    }
+
+    // Look up the channels of many sockets under one lock, skipping unknown ones
+    void findAll(const std::vector<int>& sockets, std::vector<std::shared_ptr<OutboundChannel>>& found)
+    {
+        found.reserve(found.size() + sockets.size());
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (int sock : sockets)
+        {
+            auto it = channels.find(sock);
+            if (it != channels.end())
+            {
+                found.push_back(it->second);
+            }
+        }
+    }
+};
+
+#endif //OUTBOUNDCHANNEL_H
@@ -0,0 +1,42 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <functional>
+
+#include "TimingWheel.h"
+
+// What code running on an event loop can ask of it without knowing the loop itself:
+// run tasks on the loop thread and set timers there. Timers always fire on the thread
+// of the loop they were set on, so a game or session keeps all its timers on the loop
+// that owns it.
+class Scheduler
+{
+public:
+    typedef TimingWheel::TimerId TimerId;
+
+    virtual ~Scheduler() {}
+
+    // Safe from any thread
+    virtual void post(std::function<void()> task) = 0;
+    virtual void runInLoop(std::function<void()> task) = 0;
+    virtual bool isInLoopThread() const = 0;
+
+    // Loop thread only
+    virtual TimerId runAfter(TimingWheel::Clock::duration delay, std::function<void()> callback) = 0;
+    virtual bool cancelTimer(TimerId id) = 0;
+
+    // The loop running on the calling thread, null on other threads
+    static Scheduler* current()
+    {
+        return currentSlot();
+    }
+
+protected:
+    static Scheduler*& currentSlot()
+    {
+        thread_local Scheduler* scheduler = nullptr;
+        return scheduler;
+    }
+};
+
+#endif //SCHEDULER_H
@@ -0,0 +1,92 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Startup options for the server, filled from the command line
+struct ServerConfig
+{
+    int port = 8023;
+    int ioThreads = 0;  // 0 = one event loop per core
+    int workers = 0;  // command executor threads, 0 = one per core
+    std::string ioBackend = "epoll";  // "epoll" or "uring"
+    int backlog = 1024;  // listen() backlog of each loop's listening socket
+    long highWater = 1024 * 1024;  // bytes queued for a client before it is disconnected
+    int maxLine = 4096;  // longest input line accepted from a client
+    bool telnetNegotiation = true;  // offer NAWS, TTYPE and EOR to every new client
+    int compressLevel = 6;  // zlib level for MCCP2 clients, 0 = don't offer compression
+    int idleTimeout = 0;  // seconds without input before a client is disconnected, 0 = never
+    int inviteTimeout = 300;  // seconds an unanswered match invitation stays open, 0 = forever
+    std::string durability = "batch";  // "none", "batch" or "every-op", see WriteAheadLog
+    int commitWindowMs = 5;  // how long "batch" gathers changes before one fdatasync
+
+    // Parse --key=value options. Returns false on an unknown or malformed option.
+    bool parseArgs(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            size_t equalPos = arg.find('=');
+            if (arg.compare(0, 2, "--") != 0 || equalPos == std::string::npos)
+            {
+                std::cerr << "Invalid option: " << arg << std::endl;
+                return false;
+            }
+
+            std::string key = arg.substr(2, equalPos - 2);
+            std::string value = arg.substr(equalPos + 1);
+
+            if (key == "port") port = std::atoi(value.c_str());
+            else if (key == "threads") ioThreads = std::atoi(value.c_str());
+            else if (key == "workers") workers = std::atoi(value.c_str());
+            else if (key == "io") ioBackend = value;
+            else if (key == "backlog") backlog = std::atoi(value.c_str());
+            else if (key == "high-water") highWater = std::atol(value.c_str());
+            else if (key == "max-line") maxLine = std::atoi(value.c_str());
+            else if (key == "negotiate" && (value == "on" || value == "off")) telnetNegotiation = value == "on";
+            else if (key == "compress-level") compressLevel = std::atoi(value.c_str());
+            else if (key == "idle-timeout") idleTimeout = std::atoi(value.c_str());
+            else if (key == "invite-timeout") inviteTimeout = std::atoi(value.c_str());
+            else if (key == "durability") durability = value;
+            else if (key == "commit-window") commitWindowMs = std::atoi(value.c_str());
+            else
+            {
+                std::cerr << "Unknown option: --" << key << std::endl;
+                return false;
+            }
+        }
+        return port > 0 && ioThreads >= 0 && workers >= 0 && backlog > 0 && highWater > 0 && maxLine > 0 && compressLevel >= 0 && compressLevel <= 9 && idleTimeout >= 0 && inviteTimeout >= 0 && commitWindowMs >= 0 && (durability == "none" || durability == "batch" || durability == "every-op") && (ioBackend == "epoll" || ioBackend == "uring");
+    }
+
+    // Number of event loop threads to run
+    int resolvedIoThreads() const
+    {
+        if (ioThreads > 0)
+        {
+            return ioThreads;
+        }
+        unsigned int cores = std::thread::hardware_concurrency();
+        return cores > 0 ? static_cast<int>(cores) : 1;
+    }
+
+    // Number of threads running client commands
+    int resolvedWorkers() const
+    {
+        if (workers > 0)
+        {
+            return workers;
+        }
+        unsigned int cores = std::thread::hardware_concurrency();
+        return cores > 0 ? static_cast<int>(cores) : 1;
+    }
+
+    static void printUsage(const char* program)
+    {
+        std::cerr << "Usage: " << program << " [--port=N] [--threads=N] [--workers=N] [--io=epoll|uring] [--backlog=N] [--high-water=BYTES] [--max-line=N] [--negotiate=on|off] [--compress-level=0-9] [--idle-timeout=SECS] [--invite-timeout=SECS] [--durability=none|batch|every-op] [--commit-window=MS]" << std::endl;
+    }
+};
+
+#endif //SERVERCONFIG_H
@@ -0,0 +1,69 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <memory>
+#include <string>
+#include "User.h"
+#include "Game.h"
+
+// Who is logged in on one connection. The User is resolved once when the session
+// opens and held until logout or disconnect, so commands read it here instead of
+// looking it up in UserManager's map (and taking its lock) every time. Only the
+// connection's commands touch it, and those run one at a time.
+class Session
+{
+public:
+    Session() : id(UserIds::NONE), gameId(-1) {}
+
+    void open(const std::shared_ptr<User>& account)
+    {
+        user = account;
+        id = account->getId();
+        username = account->getUsername();
+        game.reset();
+        gameId = -1;
+    }
+
+    void close()
+    {
+        user.reset();
+        id = UserIds::NONE;
+        username.clear();
+        game.reset();
+        gameId = -1;
+    }
+
+    bool isOpen() const { return user != nullptr; }
+    bool isGuest() const { return user && user->isUserGuest(); }
+    UserId getId() const { return id; }
+    const std::string& getUsername() const { return username; }
+    const std::shared_ptr<User>& getUser() const { return user; }
+
+    // The game the user plays or observes, nullptr if none. The handle is kept while
+    // the user stays in the same game; it is weak, so a game the manager has dropped
+    // isn't kept alive here.
+    std::shared_ptr<Game> getGame()
+    {
+        int current = user ? user->getGameId() : -1;
+        if (current < 0) {
+            return nullptr;
+        }
+
+        std::shared_ptr<Game> cached = game.lock();
+        if (!cached || gameId != current) {
+            cached = GameManager::getInstance().getGame(current);
+            game = cached;
+            gameId = current;
+        }
+        return cached;
+    }
+
+private:
+    std::shared_ptr<User> user;
+    UserId id;
+    std::string username;
+    std::weak_ptr<Game> game;
+    int gameId;  // the game handle was resolved for
+};
+
+#endif //SESSION_H
@@ -2,9 +2,12 @@
 #define SOCKETUTILS_H
 
 #include <sys/fcntl.h>
-#include <poll.h>
 #include <cstring>
-#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "OutboundChannel.h"
 
 class SocketUtils
 {
@@ -28,69 +31,87 @@ public:
         return true;
     }
 
-    // Send data to socket
-    static bool sendData(int sock, const std::string& data)
+    // Queue data for a socket. Never blocks: the event loop owning the socket writes
+    // it out once the socket is writable. Droppable messages (chat) may be discarded
+    // for a client that is falling behind.
+    static bool sendData(int sock, const std::string& data, bool droppable = false)
     {
         // Check for valid socket
         if (sock < 0) {
             return false;
         }
 
-        ssize_t total = 0;
-        ssize_t bytesleft = data.length();
-        ssize_t n;
+        std::shared_ptr<OutboundChannel> channel = ChannelRegistry::getInstance().find(sock);
+        if (!channel) {
+            return false;
+        }
+        return channel->send(data, droppable);
+    }
 
-        while (total < static_cast<ssize_t>(data.length()))
-        {
-            n = send(sock, data.c_str() + total, bytesleft, 0);
-            if (n == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    continue;
-                }
-                else
-                {
-                    return false;
-                }
-            }
-            total += n;
-            bytesleft -= n;
+    // Same for a message made of shared pieces, queued back to back
+    static bool sendData(int sock, const std::vector<OutboundChannel::Buffer>& parts, bool droppable = false)
+    {
+        if (sock < 0) {
+            return false;
         }
-        return true;
+
+        std::shared_ptr<OutboundChannel> channel = ChannelRegistry::getInstance().find(sock);
+        if (!channel) {
+            return false;
+        }
+        return channel->send(parts, droppable);
+    }
+
+    // Wrap a formatted message so it can be queued for many sockets without copying
+    static OutboundChannel::Buffer makeBuffer(std::string data)
+    {
+        return std::make_shared<const std::string>(std::move(data));
     }
 
-    // Receive data from socket with timeout
-    static std::string receiveData(int sock, int timeout_ms = 1000)
+    // "\r\n" as a shared buffer, to end messages built from shared pieces
+    static const OutboundChannel::Buffer& lineEnd()
     {
-        char buffer[4096];
-        std::string received;
-        struct pollfd pfd;
-        pfd.fd = sock;
-        pfd.events = POLLIN;
-
-        int ret = poll(&pfd, 1, timeout_ms);
-        if (ret > 0)
+        static const OutboundChannel::Buffer crlf = makeBuffer("\r\n");
+        return crlf;
+    }
+
+    // Queue one shared buffer for every socket in the list. The message is formatted
+    // once by the caller; each recipient only costs a pointer push.
+    // Returns the number of sockets it was queued for.
+    static size_t broadcast(const std::vector<int>& sockets, const OutboundChannel::Buffer& data,
+                            bool droppable = false)
+    {
+        std::vector<std::shared_ptr<OutboundChannel>> channels;
+        ChannelRegistry::getInstance().findAll(sockets, channels);
+
+        size_t sent = 0;
+        for (auto& channel : channels)
         {
-            if (pfd.revents & POLLIN)
+            if (channel->send(data, droppable))
             {
-                memset(buffer, 0, sizeof(buffer));
-                ssize_t nbytes = recv(sock, buffer, sizeof(buffer) - 1, 0);
-                if (nbytes > 0)
-                {
-                    received = std::string(buffer, nbytes);
-                }
+                sent++;
             }
         }
-        else if (ret == 0)
-        {
-            // Timeout
-        }
-        else
+        return sent;
+    }
+
+    // Same with messages made of shared pieces; clients in delta mode get the
+    // compact version of the message
+    static size_t broadcast(const std::vector<int>& sockets, const std::vector<OutboundChannel::Buffer>& full,
+                            const std::vector<OutboundChannel::Buffer>& delta, bool droppable = false)
+    {
+        std::vector<std::shared_ptr<OutboundChannel>> channels;
+        ChannelRegistry::getInstance().findAll(sockets, channels);
+
+        size_t sent = 0;
+        for (auto& channel : channels)
         {
-            perror("poll");
+            if (channel->send(channel->isDeltaMode() ? delta : full, droppable))
+            {
+                sent++;
+            }
         }
-        return received;
+        return sent;
     }
 };
 
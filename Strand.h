@@ -0,0 +1,82 @@
+#ifndef STRAND_H
+#define STRAND_H
+
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Runs tasks one at a time in the order they were posted, on whichever thread finds
+// it idle: that thread runs its own task and then whatever was posted meanwhile, so a
+// strand needs no thread of its own and an idle one costs nothing. State that only
+// strand tasks touch needs no lock. Any thread may post, including a strand task
+// posting to its own strand (the task runs after the current one).
+class Strand
+{
+public:
+    Strand() : draining(false) {}
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            pendingTasks.push_back(std::move(task));
+            if (draining)
+            {
+                return;
+            }
+            draining = true;
+        }
+        drain();
+    }
+
+    // Run task right here if nothing else is running on the strand, false (and task
+    // not run) if something is
+    bool tryRun(const std::function<void()>& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            if (draining)
+            {
+                return false;
+            }
+            draining = true;
+        }
+        task();
+        drain();
+        return true;
+    }
+
+private:
+    // Run queued tasks until there are none, then let the next poster take over
+    void drain()
+    {
+        std::vector<std::function<void()>> tasks;
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(tasksMutex);
+                if (pendingTasks.empty())
+                {
+                    draining = false;
+                    return;
+                }
+                tasks.swap(pendingTasks);
+            }
+            for (auto& task : tasks)
+            {
+                task();
+            }
+            tasks.clear();
+        }
+    }
+
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> pendingTasks;
+    bool draining;  // some thread is running the strand's tasks
+};
+
+#endif //STRAND_H
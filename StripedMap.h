@@ -0,0 +1,178 @@
+#ifndef STRIPEDMAP_H
+#define STRIPEDMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A hash map split into STRIPES maps by key hash, each behind its own reader/writer
+// lock. Lookups of different keys rarely meet on a lock and lookups of the same key
+// only wait for writers. Listings copy one stripe at a time, so they see each stripe
+// at one moment but not the whole map. Every stripe counts its lookups, changes and
+// the lock acquisitions that had to wait.
+template <typename K, typename V, size_t STRIPES = 16>
+class StripedMap
+{
+public:
+    struct StripeStats
+    {
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t contended;
+    };
+
+    // Copy the value of key into value, false if there is none
+    bool find(const K& key, V& value) const
+    {
+        const Stripe& stripe = stripeFor(key);
+        std::shared_lock<std::shared_mutex> lock = readLock(stripe);
+        auto it = stripe.map.find(key);
+        if (it == stripe.map.end())
+        {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    // Add key unless it is there already; value is set to what the map holds after
+    bool insert(const K& key, V& value)
+    {
+        Stripe& stripe = stripeFor(key);
+        std::unique_lock<std::shared_mutex> lock = writeLock(stripe);
+        auto result = stripe.map.emplace(key, value);
+        if (!result.second)
+        {
+            value = result.first->second;
+        }
+        return result.second;
+    }
+
+    void assign(const K& key, const V& value)
+    {
+        Stripe& stripe = stripeFor(key);
+        std::unique_lock<std::shared_mutex> lock = writeLock(stripe);
+        stripe.map[key] = value;
+    }
+
+    // Remove key, copying what it held into value; false if it wasn't there
+    bool erase(const K& key, V& value)
+    {
+        Stripe& stripe = stripeFor(key);
+        std::unique_lock<std::shared_mutex> lock = writeLock(stripe);
+        auto it = stripe.map.find(key);
+        if (it == stripe.map.end())
+        {
+            return false;
+        }
+        value = std::move(it->second);
+        stripe.map.erase(it);
+        return true;
+    }
+
+    bool erase(const K& key)
+    {
+        V value;
+        return erase(key, value);
+    }
+
+    // Every entry, copied out stripe by stripe
+    std::vector<std::pair<K, V>> snapshot() const
+    {
+        std::vector<std::pair<K, V>> entries;
+        for (const Stripe& stripe : stripes)
+        {
+            std::shared_lock<std::shared_mutex> lock = readLock(stripe);
+            entries.insert(entries.end(), stripe.map.begin(), stripe.map.end());
+        }
+        return entries;
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (const Stripe& stripe : stripes)
+        {
+            std::shared_lock<std::shared_mutex> lock = readLock(stripe);
+            total += stripe.map.size();
+        }
+        return total;
+    }
+
+    std::vector<StripeStats> stats() const
+    {
+        std::vector<StripeStats> result;
+        for (const Stripe& stripe : stripes)
+        {
+            result.push_back({stripe.reads.load(std::memory_order_relaxed),
+                              stripe.writes.load(std::memory_order_relaxed),
+                              stripe.contended.load(std::memory_order_relaxed)});
+        }
+        return result;
+    }
+
+    // One line summing up the stripes, for the shutdown log
+    std::string summary() const
+    {
+        uint64_t reads = 0, writes = 0, contended = 0, busiest = 0;
+        for (const StripeStats& stripe : stats())
+        {
+            reads += stripe.reads;
+            writes += stripe.writes;
+            contended += stripe.contended;
+            busiest = std::max(busiest, stripe.contended);
+        }
+        return std::to_string(reads) + " reads, " + std::to_string(writes) + " writes, " +
+               std::to_string(contended) + " waited for a lock (at most " + std::to_string(busiest) +
+               " on one of " + std::to_string(STRIPES) + " stripes)";
+    }
+
+private:
+    // A cache line each, so stripes locked by different cores don't share one
+    struct alignas(64) Stripe
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<K, V> map;
+        mutable std::atomic<uint64_t> reads{0};
+        mutable std::atomic<uint64_t> writes{0};
+        mutable std::atomic<uint64_t> contended{0};
+    };
+
+    Stripe& stripeFor(const K& key) { return stripes[std::hash<K>()(key) % STRIPES]; }
+    const Stripe& stripeFor(const K& key) const { return stripes[std::hash<K>()(key) % STRIPES]; }
+
+    static std::shared_lock<std::shared_mutex> readLock(const Stripe& stripe)
+    {
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+        {
+            stripe.contended.fetch_add(1, std::memory_order_relaxed);
+            lock.lock();
+        }
+        stripe.reads.fetch_add(1, std::memory_order_relaxed);
+        return lock;
+    }
+
+    static std::unique_lock<std::shared_mutex> writeLock(Stripe& stripe)
+    {
+        std::unique_lock<std::shared_mutex> lock(stripe.mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+        {
+            stripe.contended.fetch_add(1, std::memory_order_relaxed);
+            lock.lock();
+        }
+        stripe.writes.fetch_add(1, std::memory_order_relaxed);
+        return lock;
+    }
+
+    Stripe stripes[STRIPES];
+};
+
+#endif //STRIPEDMAP_H
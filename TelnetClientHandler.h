@@ -5,39 +5,102 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <deque>
 #include <algorithm>
+#include <cctype>
 #include "User.h"
+#include "Session.h"
 #include "Game.h"
 #include "Message.h"
+#include "SocketUtils.h"
+#include "OutboundChannel.h"
+#include "LineFramer.h"
+#include "TelnetProtocol.h"
+#include "ServerConfig.h"
+#include "GameTimers.h"
+#include "CommandExecutor.h"
 #include <regex>
 #include <iostream>
 #include <fstream>
 
-class TelnetClientHandler {
+class TelnetClientHandler : public std::enable_shared_from_this<TelnetClientHandler> {
 private:
-    int clientSocket;
+    std::atomic<int> clientSocket;
+    std::shared_ptr<OutboundChannel> channel;
+    LineFramer framer;
+    TelnetProtocol protocol;
+    bool negotiate;  // offer telnet options when the client connects
+    int compressLevel;  // MCCP2 zlib level, 0 = off
+    int inviteTimeout;  // seconds an unanswered match invitation stays open
     std::atomic<bool> running;
-    std::thread handlerThread;
-    std::string username;
+    Session session;  // who is logged in here, resolved once at login
+
+    // Commands run on the executor's workers. The loop only reads and queues lines; a
+    // worker runs them one at a time, in order.
+    struct PendingLine {
+        std::string text;
+        std::string promptMark;  // as negotiated when the line was read
+    };
+    CommandExecutor* executor;
+    Scheduler* loop;  // the loop that owns the socket, set once connected
+    std::function<void()> closeCallback;  // asks the loop to close once output is written
+    std::mutex commandMutex;
+    std::deque<PendingLine> pendingLines;
+    bool commandRunning;  // a line of this client is queued on or running in the executor
+    bool disconnectPending;  // disconnected meanwhile, the worker tears down after it
+    bool quitting;  // exit was run, later input is dropped
+
+    // mail being composed, filled line by line until a lone "."
+    bool composingMail;
+    std::string mailRecipient;
+    UserId mailRecipientId;
+    std::string mailTitle;
+    std::string mailContent;
     struct MatchInvitation {
         std::string inviter;
         std::string invitee;
         std::string colorStr;
         int timeLimit;
+        // expiry timer, set on the inviter's loop; the serial tells a replaced invitation apart
+        unsigned long serial;
+        Scheduler* owner;
+        Scheduler::TimerId timerId;
     };
+    // reply of the current command when it is made of shared buffers (a cached board)
+    std::vector<OutboundChannel::Buffer> sharedReply;
+    // the reply of the current command is sent once its change is on disk
+    bool replyDeferred;
+
     static std::unordered_map<std::string, MatchInvitation> pendingInvitations;
+    static std::mutex invitationsMutex;
+    static unsigned long nextInvitationSerial;
 
 public:
-    bool isLoggedIn() const {return !username.empty();}
-    std::string getUsername() const{return username;}
+    bool isLoggedIn() const {return session.isOpen();}
+    std::string getUsername() const{return session.getUsername();}
+    const Session& getSession() const{return session;}
     bool isConnected() const{return running && clientSocket >= 0;}
-
-    TelnetClientHandler(int socket)
-        : clientSocket(socket), running(true), username("")
+    int getSocket() const{return clientSocket;}
+    std::shared_ptr<OutboundChannel> getChannel() const{return channel;}
+
+    // The event loop that owns the socket drives this handler, so it needs no thread of its own
+    TelnetClientHandler(int socket, const ServerConfig& config, CommandExecutor* commands)
+        : clientSocket(socket),
+          channel(std::make_shared<OutboundChannel>(socket, static_cast<size_t>(config.highWater))),
+          framer(static_cast<size_t>(config.maxLine)),
+          protocol([this](const std::string& bytes) { channel->send(bytes); }),
+          negotiate(config.telnetNegotiation), compressLevel(config.compressLevel),
+          inviteTimeout(config.inviteTimeout),
+          running(true), executor(commands), loop(nullptr), commandRunning(false), disconnectPending(false),
+          quitting(false), composingMail(false), mailRecipientId(UserIds::NONE),
+          replyDeferred(false)
     {
-        // Start thread
-        handlerThread = std::thread(&TelnetClientHandler::handleClient, this);
-        handlerThread.detach();
+        protocol.allowCompression(compressLevel > 0);
+        protocol.setOptionListener([this](unsigned char option, bool local, bool enabled) {
+            if (local && option == TelnetProtocol::OPT_COMPRESS2) {
+                setCompression(enabled);
+            }
+        });
     }
 
     ~TelnetClientHandler()
@@ -45,35 +108,64 @@ public:
         running = false;
     }
 
-    bool sendMessage(const std::string& message) const
+    bool sendMessage(const std::string& message, bool droppable = false) const
     {
         if (clientSocket >= 0) {
-            return SocketUtils::sendData(clientSocket, message + "\r\n");
+            return channel->send(message + "\r\n", droppable);
         }
         return false;    }
 
+    // Called once the loop has dropped the connection. A command still running keeps
+    // the socket until it is done, so its replies and the socket number stay its own.
     void disconnect()
+    {
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            quitting = true;
+            pendingLines.clear();
+            if (commandRunning) {
+                disconnectPending = true;
+                return;
+            }
+        }
+        finishDisconnect();
+    }
+
+    void setCloseCallback(std::function<void()> callback)
+    {
+        closeCallback = std::move(callback);
+    }
+
+private:
+    void finishDisconnect()
     {
         if (running) {
             running = false;
 
             // game abandonment if the user is in a game
-            if (!username.empty()) {
-                auto currentUser = UserManager::getInstance().getUserByUsername(username);
-                if (currentUser && currentUser->isInGame()) {
-                    int gameId = currentUser->getGameId();
-                    auto game = GameManager::getInstance().getGame(gameId);
-                    if (game) {
-                        // player disconnection in the game
-                        handlePlayerDisconnection(game, currentUser);
-                    }
+            if (session.isOpen()) {
+                auto currentUser = session.getUser();
+                auto game = session.getGame();
+                if (game && currentUser->isInGame()) {
+                    // player disconnection in the game
+                    handlePlayerDisconnection(game, currentUser);
+                } else if (game && currentUser->isUserObserving()) {
+                    // the socket number is reused, so it must not stay an observer
+                    int socket = clientSocket;
+                    game->getStrand().post([game, socket]() { game->removeObserver(socket); });
                 }
 
                 // log out user
                 UserManager::getInstance().logoutUser(clientSocket);
-                username = "";
+                session.close();
             }
 
+            // Nothing more gets queued once the socket is closed
+            channel->close();
+            ChannelRegistry::getInstance().remove(channel);
+            logChannelStats();
+            logCompressionStats();
+
             if (clientSocket >= 0) {
                 close(clientSocket);
                 clientSocket = -1;
@@ -81,29 +173,32 @@ public:
         }
     }
 
+public:
     void handlePlayerDisconnection(std::shared_ptr<Game> game, std::shared_ptr<User> player) {
-        // Get the opponent
-        std::shared_ptr<User> opponent;
-        if (player->getUsername() == game->getBlackPlayer()->getUsername()) {
-            opponent = game->getWhitePlayer();
-        } else {
-            opponent = game->getBlackPlayer();
-        }
+        game->getStrand().post([game, player]() {
+            // The game may have ended while this waited for the strand
+            if (game->getStatus() != GameStatus::PLAYING) {
+                return;
+            }
 
-        // Notify the opponent and observers
-        std::string disconnectMsg = player->getUsername() + " has disconnected. " +
-                                    opponent->getUsername() + " wins by default.";
+            // Get the opponent
+            std::shared_ptr<User> opponent;
+            if (player->getId() == game->getBlackPlayer()->getId()) {
+                opponent = game->getWhitePlayer();
+            } else {
+                opponent = game->getBlackPlayer();
+            }
 
-        if (opponent->getSocket() != -1) {
-            SocketUtils::sendData(opponent->getSocket(), disconnectMsg + "\r\n");
-        }
+            // Notify the opponent and observers
+            std::string disconnectMsg = player->getUsername() + " has disconnected. " +
+                                        opponent->getUsername() + " wins by default.";
 
-        for (int observerSocket : game->getObservers()) {
-            SocketUtils::sendData(observerSocket, disconnectMsg + "\r\n");
-        }
+            SocketUtils::broadcast(gameAudience(game, opponent), SocketUtils::makeBuffer(disconnectMsg + "\r\n"));
 
-        // End the game with the opponent as winner
-        game->playerDisconnected(player);
+            // End the game with the opponent as winner
+            game->playerDisconnected(player);
+            GameTimers::finished(game);
+        });
     }
 
 private:
@@ -111,16 +206,16 @@ private:
     std::string loginUser(const std::string& username, const std::string& password)
     {
         // If already logged in, log out first
-        if (!this->username.empty()) {
+        if (session.isOpen()) {
             UserManager::getInstance().logoutUser(clientSocket);
-            this->username = "";
+            session.close();
         }
 
-        if (UserManager::getInstance().loginUser(username, password, clientSocket)) {
-            this->username = username;
+        if (auto user = UserManager::getInstance().loginUser(username, password, clientSocket)) {
+            session.open(user);
 
             // Check for unread messages
-            int unreadCount = MessageManager::getInstance().countUnreadMessages(username);
+            int unreadCount = MessageManager::getInstance().countUnreadMessages(session.getId());
             std::string loginMsg = "Login successful. Welcome, " + username + "!";
 
             if (unreadCount > 0) {
@@ -148,6 +243,7 @@ private:
         help += "<A|B|...|O><1|2|...|15> # Make a move in a game\n";
         help += "resign                  # Resign a game\n";
         help += "refresh                 # Refresh a game\n";
+        help += "delta <on|off>          # Get moves as one-line events instead of boards\n";
         help += "shout <msg>             # shout <msg> to every one online\n";
         help += "tell <name> <msg>       # tell user <name> message\n";
         help += "kibitz <msg>            # Comment on a game when observing\n";
@@ -178,62 +274,291 @@ private:
         return "Online users: \n- guest";
     }
 
-    void handleClient()
+public:
+    // Called by the event loop once the socket is registered
+    void onConnected()
     {
-        int timeout_ms = 10000;
+        loop = Scheduler::current();
+        if (negotiate) {
+            protocol.start();
+        }
 
         // Send welcome message
         sendMessage("Welcome to Gomoku Server!");
         sendMessage(showHelp());
+    }
+
+    // Called by the event loop with the bytes of one read. Telnet commands are taken
+    // out, then every complete line is queued for the executor, which runs them in
+    // order. Returns false once the connection should be closed.
+    bool onData(const char* data, size_t length)
+    {
+        bool keepOpen = protocol.feed(data, length, [this](const char* bytes, size_t count) {
+            return framer.feed(bytes, count, [this](const std::string& line) {
+                reportOverlongLines();
+                queueLine(line);
+                return true;
+            });
+        });
+        reportOverlongLines();
+        return keepOpen && running;
+    }
+
+private:
+    // Sockets of a game's opponent (or other player) followed by its observers
+    static std::vector<int> gameAudience(const std::shared_ptr<Game>& game, const std::shared_ptr<User>& player)
+    {
+        std::vector<int> observers = game->getObservers();
+        std::vector<int> recipients;
+        recipients.reserve(observers.size() + 1);
+        recipients.push_back(player->getSocket());
+        recipients.insert(recipients.end(), observers.begin(), observers.end());
+        return recipients;
+    }
 
-        // Main command loop
-        while (running)
+    // The timer lives on the inviter's loop, which may not be this one
+    static void cancelInvitationTimer(const MatchInvitation& invitation)
+    {
+        if (invitation.owner && invitation.timerId != 0) {
+            Scheduler* owner = invitation.owner;
+            Scheduler::TimerId timerId = invitation.timerId;
+            owner->runInLoop([owner, timerId]() { owner->cancelTimer(timerId); });
+        }
+    }
+
+    // Timers are set on the loop thread; the id is kept only if the invitation wasn't
+    // answered or replaced before the loop got to it
+    static void armInvitationTimer(Scheduler* owner, const std::string& key, unsigned long serial, int seconds)
+    {
+        owner->runInLoop([owner, key, serial, seconds]() {
+            Scheduler::TimerId timerId = owner->runAfter(std::chrono::seconds(seconds),
+                [key, serial]() { expireInvitation(key, serial); });
+
+            std::lock_guard<std::mutex> lock(invitationsMutex);
+            auto it = pendingInvitations.find(key);
+            if (it != pendingInvitations.end() && it->second.serial == serial) {
+                it->second.timerId = timerId;
+            } else {
+                owner->cancelTimer(timerId);
+            }
+        });
+    }
+
+    // Drop an invitation nobody answered, unless it was accepted or replaced meanwhile
+    static void expireInvitation(const std::string& key, unsigned long serial)
+    {
+        MatchInvitation invitation;
         {
-            std::string rawData = SocketUtils::receiveData(clientSocket, timeout_ms);
-
-            // Strip telnet control sequences and control characters
-            std::string result;
-            for (char c : rawData)
-            {
-                if (c >= 32 && c < 127)
-                { // Printable ASCII
-                    result += c;
-                }
-                else if (c == '\r' || c == '\n')
-                {
-                    result += c;
-                }
+            std::lock_guard<std::mutex> lock(invitationsMutex);
+            auto it = pendingInvitations.find(key);
+            if (it == pendingInvitations.end() || it->second.serial != serial) {
+                return;
             }
+            invitation = it->second;
+            pendingInvitations.erase(it);
+        }
+
+        auto inviter = UserManager::getInstance().getUserByUsername(invitation.inviter);
+        if (inviter && inviter->getSocket() != -1) {
+            SocketUtils::sendData(inviter->getSocket(), "Your match invitation to " + invitation.invitee +
+                                                        " has expired.\r\n");
+        }
+    }
+
+    // MCCP2: everything after IAC SB COMPRESS2 IAC SE is one zlib stream
+    void setCompression(bool enabled)
+    {
+        if (!enabled) {
+            channel->stopCompression();
+            return;
+        }
+
+        std::string start;
+        start += static_cast<char>(TelnetProtocol::IAC);
+        start += static_cast<char>(TelnetProtocol::SB);
+        start += static_cast<char>(TelnetProtocol::OPT_COMPRESS2);
+        start += static_cast<char>(TelnetProtocol::IAC);
+        start += static_cast<char>(TelnetProtocol::SE);
+        if (!channel->startCompression(compressLevel, std::make_shared<const std::string>(start))) {
+            std::cerr << "Could not start MCCP2 compression on socket " << clientSocket << std::endl;
+        }
+    }
+
+    // What was written to the client, and how much chat was dropped because it read too slowly
+    void logChannelStats() const
+    {
+        std::cout << "Socket " << clientSocket << " closed: " << channel->getBytesWritten() << " bytes in "
+                  << channel->getWriteCount() << " writes";
+        size_t dropped = channel->getDroppedMessages();
+        if (dropped > 0) {
+            std::cout << ", " << dropped << " chat messages dropped as a slow reader";
+        }
+        std::cout << std::endl;
+    }
+
+    void logCompressionStats() const
+    {
+        const MccpCompressor* compressor = channel->getCompressor();
+        if (!compressor || compressor->getBytesIn() == 0) {
+            return;
+        }
+
+        std::cout << "Socket " << clientSocket << " MCCP2: " << compressor->getBytesIn() << " -> "
+                  << compressor->getBytesOut() << " bytes ("
+                  << (100 * compressor->getBytesOut() / compressor->getBytesIn()) << "%), "
+                  << (compressor->getCpuNanos() / 1000) << " us deflate CPU" << std::endl;
+    }
+
+    // Tell telnet clients the reply is complete (IAC EOR or IAC GA)
+    void markPrompt(const std::string& mark)
+    {
+        if (!mark.empty()) {
+            channel->send(mark);
+        }
+    }
+
+    void reportOverlongLines()
+    {
+        if (framer.takeOverlongLines() > 0) {
+            sendMessage("Line too long (max " + std::to_string(framer.getMaxLineLength()) + " characters), ignored.");
+        }
+    }
+
+    // Moves and resignations come first, someone's clock is running. Mail, shouts and
+    // the commands that write to disk go last. Only the first word is looked at. Called
+    // when the line is handed to the executor, after the client's previous command
+    // has finished, so whether a mail body is being composed is known.
+    CommandExecutor::Lane laneFor(const std::string& line) const
+    {
+        if (composingMail) {
+            return CommandExecutor::BULK;
+        }
+
+        std::istringstream iss(line);
+        std::string cmd;
+        iss >> cmd;
+        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::tolower);
+
+        bool move = cmd.size() >= 2 && cmd.size() <= 3 && std::isalpha(static_cast<unsigned char>(cmd[0])) &&
+                    std::all_of(cmd.begin() + 1, cmd.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
+        if (move || cmd == "resign") {
+            return CommandExecutor::GAME;
+        }
+        if (cmd == "mail" || cmd == "listmail" || cmd == "readmail" || cmd == "deletemail" || cmd == "shout" ||
+            cmd == "register" || cmd == "passwd" || cmd == "info" || cmd == "block" || cmd == "unblock") {
+            return CommandExecutor::BULK;
+        }
+        return CommandExecutor::INTERACTIVE;
+    }
+
+    // Loop side: queue a line behind this client's earlier ones
+    void queueLine(const std::string& line)
+    {
+        PendingLine pending = {line, protocol.promptMark()};
+        std::lock_guard<std::mutex> lock(commandMutex);
+        if (quitting) {
+            return;
+        }
+        pendingLines.push_back(std::move(pending));
+        if (!commandRunning) {
+            commandRunning = submitNext();
+        }
+    }
+
+    // Hand the first queued line to the executor; commandMutex held and no command of
+    // this client running. False if the executor has stopped: the server is shutting
+    // down, so the queued lines are dropped
+    bool submitNext()
+    {
+        std::shared_ptr<TelnetClientHandler> self = shared_from_this();
+        if (executor->submit(laneFor(pendingLines.front().text), [self]() { self->runNextLine(); })) {
+            return true;
+        }
+        pendingLines.clear();
+        return false;
+    }
 
-            // Get first line
-            size_t pos = result.find("\r\n");
-            if (pos != std::string::npos)
-            {
-                result = result.substr(0, pos);
+    // Worker side: run the first queued line, then pass on the next one
+    void runNextLine()
+    {
+        PendingLine line;
+        bool cleared = false;
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            if (pendingLines.empty()) {
+                // Cleared by a disconnect after this was submitted
+                cleared = true;
+            } else {
+                line = std::move(pendingLines.front());
+                pendingLines.pop_front();
             }
+        }
 
-            if (result.empty())
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
+        bool keepOpen = !cleared && onLine(line.text, line.promptMark);
+
+        bool teardown;
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            if (!keepOpen) {
+                quitting = true;
+                pendingLines.clear();
+            }
+            if (!pendingLines.empty() && submitNext()) {
+                return;
             }
+            commandRunning = false;
+            teardown = disconnectPending;
+            disconnectPending = false;
+        }
 
-            // Process command
-            std::string response = processCommand(result);
-            sendMessage(response);
+        if (teardown) {
+            finishDisconnect();
+        } else if (!keepOpen && closeCallback) {
+            closeCallback();
+        }
+    }
+
+    // Run one line of input. Returns false once the connection should be closed.
+    bool onLine(const std::string& line, const std::string& promptMark)
+    {
+        if (composingMail) {
+            continueMail(line);
+            return running;
+        }
 
-            // Handle exit command
-            if (result == "exit" || result == "quit") {
-                disconnect();
-                running = false;
-                break;
+        // Strip control characters
+        std::string result;
+        for (char c : line)
+        {
+            if (c >= 32 && c < 127)
+            { // Printable ASCII
+                result += c;
             }
         }
-        // Make sure socket is closed
-        if (clientSocket >= 0) {
-            close(clientSocket);
-            clientSocket = -1;
+
+        if (result.empty())
+        {
+            return true;
+        }
+
+        // Process command
+        std::string response = processCommand(result);
+        if (replyDeferred) {
+            replyDeferred = false;
+        } else if (sharedReply.empty()) {
+            sendMessage(response);
+        } else {
+            sharedReply.push_back(SocketUtils::lineEnd());
+            channel->send(sharedReply);
+            sharedReply.clear();
+        }
+        markPrompt(promptMark);
+
+        // Handle exit command, the event loop closes the connection
+        if (result == "exit" || result == "quit") {
+            return false;
         }
+        return running;
     }
 
     std::string listCurrentGames() {
@@ -261,12 +586,12 @@ private:
     }
 
     std::string initiateMatch(const std::string& opponentName, const std::string& colorStr, int timeLimit) {
-    if (username == "guest") {
+    if (session.isGuest()) {
         return "Guests cannot play games. Please register an account.";
     }
 
     // Prevent matching with yourself
-    if (username == opponentName) {
+    if (session.getUsername() == opponentName) {
         return "You cannot play against yourself.";
     }
 
@@ -274,7 +599,7 @@ private:
         return "Color must be 'b' for black or 'w' for white.";
     }
 
-    auto currentUser = UserManager::getInstance().getUserByUsername(username);
+    auto currentUser = session.getUser();
     if (currentUser->isInGame()) {
         return "You are already in a game.";
     }
@@ -293,8 +618,10 @@ private:
     }
 
     // Generate invitation key
-    std::string invitationKey = username + "_" + opponentName;
-    std::string reverseKey = opponentName + "_" + username;
+    std::string invitationKey = session.getUsername() + "_" + opponentName;
+    std::string reverseKey = opponentName + "_" + session.getUsername();
+
+    std::unique_lock<std::mutex> lock(invitationsMutex);
 
     // Check if this is responding to an existing invitation
     if (pendingInvitations.find(reverseKey) != pendingInvitations.end()) {
@@ -324,37 +651,59 @@ private:
 
         // Remove the invitation
         pendingInvitations.erase(reverseKey);
+        lock.unlock();
+        cancelInvitationTimer(invitation);
 
         // Create the game
-        int gameId = GameManager::getInstance().createGame(blackPlayer, whitePlayer, actualTimeLimit);
+        int gameId = GameManager::getInstance().createGame(blackPlayer, whitePlayer, actualTimeLimit, loop);
 
-        // Get the game board
+        // Its clock runs on this loop; the opponent may move as soon as the game exists,
+        // so the board is read on its strand
         auto game = GameManager::getInstance().getGame(gameId);
-        std::string gameBoard = game->getBoardString();
-
         std::string gameStartMsg = "Game " + std::to_string(gameId) + " started: " +
                                 blackPlayer->getUsername() + " (Black) vs " +
                                 whitePlayer->getUsername() + " (White)";
 
-        // Send notification and board to opponent
-        SocketUtils::sendData(opponent->getSocket(), gameStartMsg + "\r\n\n" + gameBoard + "\r\n");
+        return onGameStrand(game, [game, opponent, gameStartMsg]() -> std::vector<OutboundChannel::Buffer> {
+            GameTimers::started(game);
+            OutboundChannel::Buffer gameBoard = game->getBoardFrame();
+
+            // Send notification and board to opponent
+            SocketUtils::sendData(opponent->getSocket(),
+                                  {SocketUtils::makeBuffer(gameStartMsg + "\r\n\n"), gameBoard, SocketUtils::lineEnd()});
 
-        // Return notification and board to current user
-        return gameStartMsg + "\n\n" + gameBoard;
+            // Return notification and board to current user
+            return {SocketUtils::makeBuffer(gameStartMsg + "\n\n"), gameBoard};
+        });
     } else {
         // This is a new invitation
         MatchInvitation invitation;
-        invitation.inviter = username;
+        invitation.inviter = session.getUsername();
         invitation.invitee = opponentName;
         invitation.colorStr = colorStr;
         invitation.timeLimit = timeLimit;
+        invitation.serial = nextInvitationSerial++;
+        invitation.owner = loop;
+        invitation.timerId = 0;
 
+        // A repeated invitation replaces the old one and restarts its expiry
+        auto previous = pendingInvitations.find(invitationKey);
+        if (previous != pendingInvitations.end()) {
+            cancelInvitationTimer(previous->second);
+        }
         pendingInvitations[invitationKey] = invitation;
+        lock.unlock();
+
+        // Armed without the lock: on the owner's loop the timer is set right here, and
+        // storing its id takes the lock
+        if (invitation.owner && inviteTimeout > 0) {
+            armInvitationTimer(invitation.owner, invitationKey, invitation.serial, inviteTimeout);
+        }
 
         // Send invitation message to opponent
-        std::string inviteMsg = username + " has invited you to play a game of Gomoku " +
+        std::string inviteMsg = session.getUsername() + " has invited you to play a game of Gomoku " +
                              (colorStr == "b" ? "as White" : "as Black") +
-                             ".\nType 'match " + username + " " +
+                             ".\nType 'match " + session.getUsername() + " " +
                              (colorStr == "b" ? "w" : "b") + " " +
                              std::to_string(timeLimit) + "' to accept.";
 
@@ -363,51 +712,103 @@ private:
         return "Match invitation sent to " + opponentName + ". Waiting for them to accept.";
     }
 }
+    // Switch between full boards and one-line move events for game updates
+    std::string setDeltaMode(bool enabled) {
+        channel->setDeltaMode(enabled);
+        if (!enabled) {
+            return "Delta mode off. Every move shows the full board.";
+        }
+        return "Delta mode on. Moves arrive as '@move <game> <move> <point> <B|W> <black secs> <white secs> <hash>',\n"
+               "with the full board every " + std::to_string(Game::KEYFRAME_INTERVAL) + " moves. Use 'refresh' to see the board.";
+    }
+
+    // Send reply once the change the manager just logged is durable. Its place in the
+    // output is kept, so later output (the prompt, other commands) waits behind it.
+    template <typename Manager>
+    void sendWhenDurable(Manager& manager, const std::string& reply, std::function<void()> then = nullptr) {
+        uint64_t slot = channel->reserve();
+        std::shared_ptr<OutboundChannel> target = channel;
+        manager.whenDurable([target, slot, reply, then]() {
+            target->fill(slot, std::make_shared<const std::string>(reply + "\r\n"));
+            if (then) {
+                then();
+            }
+        });
+    }
+
+    // Reply with shared buffers instead of a string, sent with the usual line end
+    std::string replyShared(std::vector<OutboundChannel::Buffer> parts) {
+        sharedReply = std::move(parts);
+        return "";
+    }
+
+    typedef std::function<std::vector<OutboundChannel::Buffer>()> GameWork;
+
+    // Run work on the game's strand and reply with what it returns. The strand is
+    // usually free and the work runs right here; otherwise it runs when the strand
+    // gets to it, maybe on another thread, and the reply keeps this command's place in
+    // the output. So work may use only what it captured, never the handler.
+    std::string onGameStrand(const std::shared_ptr<Game>& game, const GameWork& work) {
+        std::vector<OutboundChannel::Buffer> reply;
+        if (game->getStrand().tryRun([&reply, &work]() { reply = work(); })) {
+            return replyShared(std::move(reply));
+        }
+
+        uint64_t slot = channel->reserve();
+        std::shared_ptr<OutboundChannel> target = channel;
+        game->getStrand().post([target, slot, work]() {
+            std::string joined;
+            for (const auto& part : work()) {
+                joined += *part;
+            }
+            target->fill(slot, std::make_shared<const std::string>(joined + "\r\n"));
+        });
+        replyDeferred = true;
+        return "";
+    }
+
     // Resign from the current game
     std::string resignGame() {
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser->isInGame()) {
             return "You are not in a game.";
         }
 
-        int gameId = currentUser->getGameId();
-        auto game = GameManager::getInstance().getGame(gameId);
+        auto game = session.getGame();
         if (!game) {
             currentUser->setPlaying(false);
             currentUser->setGameId(-1);
             return "Error: Game not found.";
         }
 
-        game->resign(currentUser);
+        std::string resignMsg = session.getUsername() + " has resigned the game.";
+        return onGameStrand(game, [game, currentUser, resignMsg]() -> std::vector<OutboundChannel::Buffer> {
+            game->resign(currentUser);
+            GameTimers::finished(game);
 
-        // Send notification to opponent
-        std::shared_ptr<User> opponent;
-        if (game->getBlackPlayer()->getUsername() == username) {
-            opponent = game->getWhitePlayer();
-        } else {
-            opponent = game->getBlackPlayer();
-        }
-
-        std::string resignMsg = username + " has resigned the game.";
-        SocketUtils::sendData(opponent->getSocket(), resignMsg + "\r\n");
+            // Send notification to opponent
+            std::shared_ptr<User> opponent;
+            if (game->getBlackPlayer()->getId() == currentUser->getId()) {
+                opponent = game->getWhitePlayer();
+            } else {
+                opponent = game->getBlackPlayer();
+            }
 
-        // Notify observers
-        for (int observerSocket : game->getObservers()) {
-            SocketUtils::sendData(observerSocket, resignMsg + "\r\n");
-        }
+            // Notify the opponent and observers
+            SocketUtils::broadcast(gameAudience(game, opponent), SocketUtils::makeBuffer(resignMsg + "\r\n"));
 
-        return "You have resigned the game.";
+            return {SocketUtils::makeBuffer("You have resigned the game.")};
+        });
     }
 
     // Refresh the current game board
     std::string refreshGame() {
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser->isInGame() && !currentUser->isUserObserving()) {
             return "You are not in or observing a game.";
         }
 
-        int gameId = currentUser->getGameId();
-        auto game = GameManager::getInstance().getGame(gameId);
+        auto game = session.getGame();
         if (!game) {
             currentUser->setPlaying(false);
             currentUser->setObserving(false);
@@ -415,12 +816,12 @@ private:
             return "Error: Game not found.";
         }
 
-        return game->getBoardString();
+        return onGameStrand(game, [game]() -> std::vector<OutboundChannel::Buffer> { return {game->getBoardFrame()}; });
     }
 
     // Observe a game
     std::string observeGame(int gameId) {
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (currentUser->isInGame()) {
             return "You cannot observe while playing a game.";
         }
@@ -431,32 +832,36 @@ private:
         }
 
         // If already observing a different game, unobserve first
+        int socket = clientSocket;
         if (currentUser->isUserObserving()) {
-            auto oldGame = GameManager::getInstance().getGame(currentUser->getGameId());
+            auto oldGame = session.getGame();
             if (oldGame) {
-                oldGame->removeObserver(clientSocket);
+                oldGame->getStrand().post([oldGame, socket]() { oldGame->removeObserver(socket); });
             }
         }
 
         // Add as observer
-        game->addObserver(clientSocket);
         currentUser->setObserving(true);
         currentUser->setGameId(gameId);
 
-        return "You are now observing game " + std::to_string(gameId) + ".\n\n" + game->getBoardString();
+        return onGameStrand(game, [game, socket, gameId]() -> std::vector<OutboundChannel::Buffer> {
+            game->addObserver(socket);
+            return {SocketUtils::makeBuffer("You are now observing game " + std::to_string(gameId) + ".\n\n"),
+                    game->getBoardFrame()};
+        });
     }
 
     // Stop observing a game
     std::string unobserveGame() {
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser->isUserObserving()) {
             return "You are not observing any game.";
         }
 
-        int gameId = currentUser->getGameId();
-        auto game = GameManager::getInstance().getGame(gameId);
+        auto game = session.getGame();
         if (game) {
-            game->removeObserver(clientSocket);
+            int socket = clientSocket;
+            game->getStrand().post([game, socket]() { game->removeObserver(socket); });
         }
 
         currentUser->setObserving(false);
@@ -466,44 +871,63 @@ private:
     }
 
     std::string makeMove(int row, int col) {
-    auto currentUser = UserManager::getInstance().getUserByUsername(username);
+    auto currentUser = session.getUser();
     if (!currentUser->isInGame()) {
         return "You are not in a game.";
     }
 
-    int gameId = currentUser->getGameId();
-    auto game = GameManager::getInstance().getGame(gameId);
+    auto game = session.getGame();
     if (!game) {
         currentUser->setPlaying(false);
         currentUser->setGameId(-1);
         return "Error: Game not found.";
     }
 
+    bool delta = channel->isDeltaMode();
+    return onGameStrand(game, [game, currentUser, delta, row, col]() {
+        return playMove(game, currentUser, delta, row, col);
+    });
+}
+
+// The move itself, on the game's strand; returns the player's reply
+static std::vector<OutboundChannel::Buffer> playMove(const std::shared_ptr<Game>& game,
+                                                     const std::shared_ptr<User>& currentUser, bool delta,
+                                                     int row, int col) {
     // Check if game is finished
     if (game->getStatus() == GameStatus::FINISHED) {
-        return "This game is already over. The winner was " + game->getWinner() + ".";
+        return {SocketUtils::makeBuffer("This game is already over. The winner was " + game->getWinner() + ".")};
     }
 
     // Check if it's this player's turn
-    bool isBlack = (currentUser->getUsername() == game->getBlackPlayer()->getUsername());
-    bool isWhite = (currentUser->getUsername() == game->getWhitePlayer()->getUsername());
+    bool isBlack = (currentUser->getId() == game->getBlackPlayer()->getId());
+    bool isWhite = (currentUser->getId() == game->getWhitePlayer()->getId());
     bool isBlackTurn = (game->getCurrentTurn() == StoneColor::BLACK);
 
     if ((isBlack && !isBlackTurn) || (isWhite && isBlackTurn)) {
-        return "It's not your turn to move. Please wait for your opponent.";
+        return {SocketUtils::makeBuffer("It's not your turn to move. Please wait for your opponent.")};
     }
 
     // Check if the position is already occupied
     if (!game->isPositionEmpty(row, col)) {
-        return "Invalid move: that position is already occupied.";
+        return {SocketUtils::makeBuffer("Invalid move: that position is already occupied.")};
     }
 
     if (!game->makeMove(currentUser, row, col)) {
-        return "Invalid move: an unexpected error occurred.";
+        // The clock ran out before the move got in
+        if (game->getStatus() == GameStatus::FINISHED) {
+            GameTimers::finished(game);
+        }
+        return {SocketUtils::makeBuffer("Invalid move: an unexpected error occurred.")};
+    }
+
+    if (game->getStatus() == GameStatus::FINISHED) {
+        GameTimers::finished(game);
+    } else {
+        GameTimers::moveMade(game);
     }
 
     std::shared_ptr<User> opponent;
-    if (game->getBlackPlayer()->getUsername() == username) {
+    if (game->getBlackPlayer()->getId() == currentUser->getId()) {
         opponent = game->getWhitePlayer();
     } else {
         opponent = game->getBlackPlayer();
@@ -511,62 +935,72 @@ private:
 
     // Create notification message
     char colChar = 'A' + col;
-    std::string moveMsg = username + " played at " + colChar + std::to_string(row + 1);
-    std::string boardStr = game->getBoardString();
+    std::string moveMsg = currentUser->getUsername() + " played at " + colChar + std::to_string(row + 1);
+    OutboundChannel::Buffer board = game->getBoardFrame();
+    const OutboundChannel::Buffer& crlf = SocketUtils::lineEnd();
 
+    // Delta clients get the move event alone, with the board only every few moves
+    std::string event = game->getMoveEvent(row, col);
 
     // Check if the game ended
     if (game->getStatus() == GameStatus::FINISHED) {
         std::string winMsg = game->getWinner() + " has won the game!";
         moveMsg += "\n" + winMsg;
 
-        // Send notification with win message to opponent
-        SocketUtils::sendData(opponent->getSocket(), moveMsg + "\r\n\n" + boardStr + "\r\n");
+        // Send notification with win message to opponent and observers
+        SocketUtils::broadcast(gameAudience(game, opponent), {SocketUtils::makeBuffer(moveMsg + "\r\n\n"), board, crlf},
+                               {SocketUtils::makeBuffer(event + "\r\n" + winMsg + "\r\n")});
+        return {SocketUtils::makeBuffer(delta ? event + "\n" + winMsg : winMsg)};
+    }
 
-        // Notify observers
-        for (int observerSocket : game->getObservers()) {
-            SocketUtils::sendData(observerSocket, moveMsg + "\r\n\n" + boardStr + "\r\n");
-        }
-        return winMsg;
+    std::vector<OutboundChannel::Buffer> deltaMsg;
+    if (game->isKeyframe()) {
+        deltaMsg = {SocketUtils::makeBuffer(event + "\r\n\n"), board, crlf};
+    } else {
+        deltaMsg = {SocketUtils::makeBuffer(event + "\r\n")};
     }
 
-        SocketUtils::sendData(opponent->getSocket(), moveMsg + "\r\n\n" + boardStr + "\r\n");
+    // Notify opponent and observers; everyone shares the move header and the cached board
+    SocketUtils::broadcast(gameAudience(game, opponent), {SocketUtils::makeBuffer(moveMsg + "\r\n\n"), board, crlf},
+                           deltaMsg);
 
-        // Notify observers
-        for (int observerSocket : game->getObservers()) {
-            SocketUtils::sendData(observerSocket, moveMsg + "\r\n\n" + boardStr + "\r\n");
+    if (delta) {
+        if (game->isKeyframe()) {
+            return {SocketUtils::makeBuffer(event + "\n\n"), board};
         }
-
-
-    return boardStr;
+        return {SocketUtils::makeBuffer(event)};
+    }
+    return {board};
 }
 
 
 // Broadcast a message to all online users
 std::string shoutMessage(const std::string& message) {
-    if (username == "guest") {
+    if (session.isGuest()) {
         return "Guests cannot shout messages. Please register an account.";
     }
 
-    std::string formattedMsg = "[Shout] " + username + ": " + message;
+    std::string formattedMsg = "[Shout] " + session.getUsername() + ": " + message;
 
     // Send to all online users except those in quiet mode or who blocked this user
+    std::vector<int> recipients;
     auto onlineUsers = UserManager::getInstance().getOnlineUsers();
     for (const auto& user : onlineUsers) {
-        if (user->getUsername() != username &&
+        if (user->getId() != session.getId() &&
             user->getSocket() != -1 &&
             !user->isInQuietMode() &&
-            !user->isBlocked(username)) {
-            SocketUtils::sendData(user->getSocket(), formattedMsg + "\r\n");
+            !user->isBlocked(session.getId())) {
+            recipients.push_back(user->getSocket());
         }
     }
+    SocketUtils::broadcast(recipients, SocketUtils::makeBuffer(formattedMsg + "\r\n"), true);
 
     return "Message sent.";
 }
 
 // Send a private message to a specific user
 std::string tellMessage(const std::string& recipient, const std::string& message) {
-    if (username == "guest") {
+    if (session.isGuest()) {
         return "Guests cannot send private messages. Please register an account.";
     }
 
@@ -575,11 +1009,11 @@ std::string tellMessage(const std::string& recipient, const std::string& message
         return "User not found: " + recipient;
     }
 
-    if (recipientUser->isBlocked(username)) {
+    if (recipientUser->isBlocked(session.getId())) {
         return recipient + " has blocked messages from you.";
     }
 
-    std::string formattedMsg = "[Tell] " + username + ": " + message;
+    std::string formattedMsg = "[Tell] " + session.getUsername() + ": " + message;
 
     // Send to recipient if online
     if (recipientUser->getSocket() != -1) {
@@ -592,52 +1026,59 @@ std::string tellMessage(const std::string& recipient, const std::string& message
 
 // Comment on a game being observed
 std::string kibitzMessage(const std::string& message) {
-    auto currentUser = UserManager::getInstance().getUserByUsername(username);
+    auto currentUser = session.getUser();
     if (!currentUser->isUserObserving()) {
         return "You are not observing a game.";
     }
 
-    int gameId = currentUser->getGameId();
-    auto game = GameManager::getInstance().getGame(gameId);
+    auto game = session.getGame();
     if (!game) {
         currentUser->setObserving(false);
         currentUser->setGameId(-1);
         return "Error: Game not found.";
     }
 
-    std::string formattedMsg = "[Kibitz] " + username + ": " + message;
+    std::string formattedMsg = "[Kibitz] " + session.getUsername() + ": " + message;
+    UserId sender = session.getId();
+    int socket = clientSocket;
 
-    // Send to all observers of this game
-    for (int observerSocket : game->getObservers()) {
-        if (observerSocket != clientSocket) {
-            auto observerUser = UserManager::getInstance().getUserBySocket(observerSocket);
-            if (observerUser && !observerUser->isInQuietMode() && !observerUser->isBlocked(username)) {
-                SocketUtils::sendData(observerSocket, formattedMsg + "\r\n");
+    // The observers list belongs to the game's strand
+    return onGameStrand(game, [game, formattedMsg, sender, socket]() -> std::vector<OutboundChannel::Buffer> {
+        // Send to all observers of this game
+        std::vector<int> recipients;
+        for (int observerSocket : game->getObservers()) {
+            if (observerSocket != socket) {
+                auto observerUser = UserManager::getInstance().getUserBySocket(observerSocket);
+                if (observerUser && !observerUser->isInQuietMode() && !observerUser->isBlocked(sender)) {
+                    recipients.push_back(observerSocket);
+                }
             }
         }
-    }
 
-    // Also send to the players if they're not in quiet mode and haven't blocked the user
-    auto blackPlayer = game->getBlackPlayer();
-    if (!blackPlayer->isInQuietMode() && !blackPlayer->isBlocked(username)) {
-        SocketUtils::sendData(blackPlayer->getSocket(), formattedMsg + "\r\n");
-    }
+        // Also send to the players if they're not in quiet mode and haven't blocked the user
+        auto blackPlayer = game->getBlackPlayer();
+        if (!blackPlayer->isInQuietMode() && !blackPlayer->isBlocked(sender)) {
+            recipients.push_back(blackPlayer->getSocket());
+        }
 
-    auto whitePlayer = game->getWhitePlayer();
-    if (!whitePlayer->isInQuietMode() && !whitePlayer->isBlocked(username)) {
-        SocketUtils::sendData(whitePlayer->getSocket(), formattedMsg + "\r\n");
-    }
+        auto whitePlayer = game->getWhitePlayer();
+        if (!whitePlayer->isInQuietMode() && !whitePlayer->isBlocked(sender)) {
+            recipients.push_back(whitePlayer->getSocket());
+        }
+
+        SocketUtils::broadcast(recipients, SocketUtils::makeBuffer(formattedMsg + "\r\n"), true);
 
-    return "Comment sent.";
+        return {SocketUtils::makeBuffer("Comment sent.")};
+    });
 }
     // Set quiet mode (no broadcast messages)
     std::string setQuietMode(bool quiet) {
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser) {
             return "Error: User not found.";
         }
 
-        currentUser->setQuietMode(quiet);
+        UserManager::getInstance().setQuietMode(session.getUsername(), quiet);
 
         return quiet ? "Quiet mode enabled. You will not receive broadcast messages."
                      : "Quiet mode disabled. You will receive broadcast messages.";
@@ -645,11 +1086,11 @@ std::string kibitzMessage(const std::string& message) {
 
     // Block a user
     std::string blockUser(const std::string& targetUsername) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot block users. Please register an account.";
         }
 
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser) {
             return "Error: User not found.";
         }
@@ -660,71 +1101,68 @@ std::string kibitzMessage(const std::string& message) {
         }
 
         // Check if already blocked
-        if (currentUser->isBlocked(targetUsername)) {
+        if (currentUser->isBlocked(targetUser->getId())) {
             return targetUsername + " is already blocked.";
         }
 
         // Block the user
-        currentUser->blockUser(targetUsername);
+        UserManager::getInstance().setBlocked(session.getUsername(), targetUsername, true);
 
         return "Blocked all communication from " + targetUsername + ".";
     }
 
     // Unblock a user
     std::string unblockUser(const std::string& targetUsername) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot unblock users. Please register an account.";
         }
 
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser) {
             return "Error: User not found.";
         }
 
         // Check if actually blocked
-        if (!currentUser->isBlocked(targetUsername)) {
+        if (!currentUser->isBlocked(UserIds::getInstance().find(targetUsername))) {
             return targetUsername + " is not blocked.";
         }
 
         // Unblock the user
-        currentUser->unblockUser(targetUsername);
+        UserManager::getInstance().setBlocked(session.getUsername(), targetUsername, false);
 
         return "Unblocked communication from " + targetUsername + ".";
     }
     // List mail headers
     std::string listMail() {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot use mail. Please register an account.";
         }
 
-        auto messages = MessageManager::getInstance().getMessages(username);
+        std::string result;
+        MessageManager::getInstance().forEachMessage(session.getId(), [&result](const Message& message) {
+            result += message.getFormattedHeader() + "\n";
+        });
 
-        if (messages.empty()) {
+        if (result.empty()) {
             return "Your mailbox is empty.";
         }
-
-        std::string result = "Mail messages:\n";
-        for (const auto& message : messages) {
-            result += message->getFormattedHeader() + "\n";
-        }
-
-        return result;
+        return "Mail messages:\n" + result;
     }
 
     // Read a specific mail
     std::string readMail(int messageId) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot use mail. Please register an account.";
         }
 
-        auto message = MessageManager::getInstance().getMessage(username, messageId);
+        auto message = MessageManager::getInstance().getMessage(session.getId(), messageId);
 
         if (!message) {
             return "Message not found.";
         }
 
         // Mark as read and save
-        MessageManager::getInstance().markMessageAsRead(username, messageId);
+        MessageManager::getInstance().markMessageAsRead(session.getId(), messageId);
 
         std::string result = "From: " + message->getSender() + "\n";
         result += "Title: " + message->getTitle() + "\n";
@@ -737,11 +1175,11 @@ std::string kibitzMessage(const std::string& message) {
 
     // Delete a mail
     std::string deleteMail(int messageId) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot use mail. Please register an account.";
         }
 
-        if (MessageManager::getInstance().deleteMessage(username, messageId)) {
+        if (MessageManager::getInstance().deleteMessage(session.getId(), messageId)) {
             return "Message deleted.";
         } else {
             return "Message not found.";
@@ -750,7 +1188,7 @@ std::string kibitzMessage(const std::string& message) {
 
     // Send  mail
     std::string sendMail(const std::string& recipient, const std::string& title) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot use mail. Please register an account.";
         }
 
@@ -759,45 +1197,54 @@ std::string kibitzMessage(const std::string& message) {
             return "User not found: " + recipient;
         }
 
-        sendMessage("Enter your message. End with a line containing only a period (.)");
-
-        std::string content;
-        std::string line;
-        while (true) {
-            line = SocketUtils::receiveData(clientSocket, 60000);
+        // The body arrives in later reads, see continueMail
+        composingMail = true;
+        mailRecipient = recipient;
+        mailRecipientId = recipientUser->getId();
+        mailTitle = title;
+        mailContent = "";
 
-            if (!line.empty() && line.back() == '\n') line.pop_back();
-            if (!line.empty() && line.back() == '\r') line.pop_back();
-
-            if (line == ".") {
-                break;
-            }
+        return "Enter your message. End with a line containing only a period (.)";
+    }
 
-            content += line + "\n";
+    // Add one line to the mail being composed, sending it on a lone "."
+    void continueMail(const std::string& line) {
+        if (line != ".") {
+            mailContent += line + "\n";
+            return;
         }
 
-        MessageManager::getInstance().sendMessage(username, recipient, title, content);
-
-        // Notify recipient if online
-        if (recipientUser->getSocket() != -1) {
-            std::string notifyMsg = "You have received a new mail from " + username;
-            SocketUtils::sendData(recipientUser->getSocket(), notifyMsg + "\r\n");
+        composingMail = false;
+        if (!MessageManager::getInstance().sendMessage(session.getId(), mailRecipientId, mailTitle, mailContent)) {
+            sendMessage("Mail to " + mailRecipient + " could not be saved. Please try again later.");
+            mailContent = "";
+            return;
         }
 
-        return "Mail sent to " + recipient;
+        // Confirm and notify the recipient (if online) once the mail is saved
+        std::string sender = session.getUsername();
+        UserId recipient = mailRecipientId;
+        sendWhenDurable(MessageManager::getInstance(), "Mail sent to " + mailRecipient, [sender, recipient]() {
+            auto recipientUser = UserManager::getInstance().getUserById(recipient);
+            if (recipientUser && recipientUser->getSocket() != -1) {
+                std::string notifyMsg = "You have received a new mail from " + sender;
+                SocketUtils::sendData(recipientUser->getSocket(), notifyMsg + "\r\n");
+            }
+        });
+        mailContent = "";
     }
     // Update user info
     std::string setUserInfo(const std::string& info) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot set personal information. Please register an account.";
         }
 
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser) {
             return "Error: User not found.";
         }
 
-        currentUser->setInfo(info);
+        UserManager::getInstance().updateUserInfo(session.getUsername(), info);
         return "Your information has been updated.";
     }
     std::string processCommand(const std::string& command)
@@ -821,7 +1268,7 @@ std::string kibitzMessage(const std::string& message) {
         std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::tolower);
         std::string cmdStr = cmd;
         if (std::regex_match(cmdStr, moveAttemptMatches, moveAttemptPattern)) {
-            auto currentUser = UserManager::getInstance().getUserByUsername(username);
+            auto currentUser = session.getUser();
             if (!currentUser->isInGame()) {
                 return "You are not in a game. Join a game first to make moves.";
             }
@@ -978,9 +1425,15 @@ std::string kibitzMessage(const std::string& message) {
         else if (cmd == "unobserve") {
             return unobserveGame();
         }
+        else if (cmd == "delta") {
+            if (tokens.size() < 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+                return "Usage: delta <on|off>";
+            }
+            return setDeltaMode(tokens[1] == "on");
+        }
 
         // For all other commands, check if user is logged in
-        if (username.empty()) {
+        if (!session.isOpen()) {
             return "Please login first using 'login <username> <password>' or 'guest'.";
         }
 
@@ -1031,7 +1484,7 @@ std::string kibitzMessage(const std::string& message) {
             if (tokens.size() > 1) {
                 return showUserStats(tokens[1]);
             } else {
-                return showUserStats(username);
+                return showUserStats(session.getUsername());
             }
         }
         else if (cmd == "info") {
@@ -1056,13 +1509,12 @@ std::string kibitzMessage(const std::string& message) {
     std::string loginGuest()
     {
         // If already logged in, log out first
-        if (!this->username.empty()) {
+        if (session.isOpen()) {
             UserManager::getInstance().logoutUser(clientSocket);
-            this->username = "";
+            session.close();
         }
 
-        UserManager::getInstance().loginGuest(clientSocket);
-        this->username = "guest";
+        session.open(UserManager::getInstance().loginGuest(clientSocket));
         return "Logged in as guest. You can register a new account using 'register <username> <password>'.";
     }
 
@@ -1070,13 +1522,16 @@ std::string kibitzMessage(const std::string& message) {
     std::string registerUser(const std::string& username, const std::string& password)
     {
         // Only allow registration if logged in as guest
-        if (this->username != "guest") {
+        if (!session.isGuest()) {
             return "You must be logged in as guest to register.";
         }
 
-        if (UserManager::getInstance().registerUser(username, password, clientSocket)) {
-            this->username = username;
-            return "Registration successful. You are now logged in as " + username + ".";
+        if (auto user = UserManager::getInstance().registerUser(username, password, clientSocket)) {
+            session.open(user);
+            sendWhenDurable(UserManager::getInstance(),
+                            "Registration successful. You are now logged in as " + username + ".");
+            replyDeferred = true;
+            return "";
         } else {
             return "Registration failed. Username already exists or is invalid.";
         }
@@ -1085,7 +1540,7 @@ std::string kibitzMessage(const std::string& message) {
     // Show user statistics
     std::string showUserStats(const std::string& targetUser)
     {
-        std::string userToShow = targetUser.empty() ? username : targetUser;
+        std::string userToShow = targetUser.empty() ? session.getUsername() : targetUser;
 
         auto user = UserManager::getInstance().getUserByUsername(userToShow);
         if (!user) {
@@ -1107,11 +1562,11 @@ std::string kibitzMessage(const std::string& message) {
     // Update user info
     std::string updateUserInfo(const std::string& info)
     {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot set info. Please register an account.";
         }
 
-        if (UserManager::getInstance().updateUserInfo(username, info)) {
+        if (UserManager::getInstance().updateUserInfo(session.getUsername(), info)) {
             return "Information updated.";
         } else {
             return "Failed to update information.";
@@ -1120,17 +1575,16 @@ std::string kibitzMessage(const std::string& message) {
 
     // Change password
     std::string changePassword(const std::string& newPassword) {
-        if (username == "guest") {
+        if (session.isGuest()) {
             return "Guests cannot change password. Please register an account.";
         }
 
-        auto currentUser = UserManager::getInstance().getUserByUsername(username);
+        auto currentUser = session.getUser();
         if (!currentUser) {
             return "Error: User not found.";
         }
 
-        currentUser->setPassword(newPassword);
-        UserManager::getInstance().saveUsers();
+        UserManager::getInstance().changePassword(session.getUsername(), newPassword);
 
         return "Your password has been changed.";
     }
@@ -1140,6 +1594,8 @@ std::string kibitzMessage(const std::string& message) {
 
 // for match invitations
 std::unordered_map<std::string, TelnetClientHandler::MatchInvitation> TelnetClientHandler::pendingInvitations;
+std::mutex TelnetClientHandler::invitationsMutex;
+unsigned long TelnetClientHandler::nextInvitationSerial = 1;
 
 
 #endif //TELNETCLIENTHANDLER_H
\ No newline at end of file
@@ -0,0 +1,334 @@
+#ifndef TELNETPROTOCOL_H
+#define TELNETPROTOCOL_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// Telnet protocol layer of one connection (RFC 854). Bytes go through a state machine
+// that survives across reads, so a negotiation split between two segments is handled
+// like any other. Runs of plain data are passed on in place, IAC sequences are taken
+// out and answered.
+class TelnetProtocol
+{
+public:
+    // Commands
+    static const unsigned char SE = 240;
+    static const unsigned char NOP = 241;
+    static const unsigned char GA = 249;
+    static const unsigned char SB = 250;
+    static const unsigned char WILL = 251;
+    static const unsigned char WONT = 252;
+    static const unsigned char DO = 253;
+    static const unsigned char DONT = 254;
+    static const unsigned char IAC = 255;
+    static const unsigned char EOR_MARK = 239;
+
+    // Options
+    static const unsigned char OPT_SGA = 3;
+    static const unsigned char OPT_TTYPE = 24;
+    static const unsigned char OPT_EOR = 25;
+    static const unsigned char OPT_NAWS = 31;
+    static const unsigned char OPT_COMPRESS2 = 86;  // MCCP2
+
+    static const unsigned char TTYPE_IS = 0;
+    static const unsigned char TTYPE_SEND = 1;
+
+    // Writes raw protocol bytes to the client
+    typedef std::function<void(const std::string& bytes)> RawSender;
+    // Told when an option is switched on or off on our side (local) or theirs
+    typedef std::function<void(unsigned char option, bool local, bool enabled)> OptionListener;
+
+    explicit TelnetProtocol(RawSender sendRaw)
+        : sendRaw(sendRaw), compressionAllowed(false), state(STATE_DATA), verb(0), telnetSeen(false),
+          width(0), height(0)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            localEnabled[i] = remoteEnabled[i] = localPending[i] = remotePending[i] = false;
+        }
+    }
+
+    void setOptionListener(OptionListener listener) { onOption = listener; }
+
+    // Offer and accept MCCP2; the listener starts the compressed stream
+    void allowCompression(bool allowed) { compressionAllowed = allowed; }
+
+    // Offer what we'd like to use. Clients that aren't telnet see a few stray bytes.
+    void start()
+    {
+        requestRemote(OPT_NAWS);
+        requestRemote(OPT_TTYPE);
+        offerLocal(OPT_EOR);
+        if (compressionAllowed)
+        {
+            offerLocal(OPT_COMPRESS2);
+        }
+    }
+
+    // Ask the client to let us enable an option of ours (WILL)
+    void offerLocal(unsigned char option)
+    {
+        if (!localEnabled[option] && !localPending[option])
+        {
+            localPending[option] = true;
+            sendCommand(WILL, option);
+        }
+    }
+
+    // Ask the client to enable an option of theirs (DO)
+    void requestRemote(unsigned char option)
+    {
+        if (!remoteEnabled[option] && !remotePending[option])
+        {
+            remotePending[option] = true;
+            sendCommand(DO, option);
+        }
+    }
+
+    // Feed the bytes of one read. onData(const char*, size_t) gets every run of plain
+    // data and returns false to stop; feed() then returns false too.
+    template <typename DataHandler>
+    bool feed(const char* data, size_t length, DataHandler onData)
+    {
+        size_t runStart = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            unsigned char c = static_cast<unsigned char>(data[i]);
+            switch (state)
+            {
+            case STATE_DATA:
+                if (c == IAC)
+                {
+                    if (i > runStart && !onData(data + runStart, i - runStart))
+                    {
+                        return false;
+                    }
+                    state = STATE_IAC;
+                }
+                continue;
+
+            case STATE_IAC:
+                telnetSeen = true;
+                if (c == IAC)
+                {
+                    // Escaped 255 data byte, it starts the next run
+                    state = STATE_DATA;
+                    runStart = i;
+                    continue;
+                }
+                if (c == WILL || c == WONT || c == DO || c == DONT)
+                {
+                    verb = c;
+                    state = STATE_OPTION;
+                }
+                else if (c == SB)
+                {
+                    subnegotiation.clear();
+                    state = STATE_SB;
+                }
+                else
+                {
+                    // NOP, GA, AYT, ... carry nothing we act on
+                    state = STATE_DATA;
+                }
+                break;
+
+            case STATE_OPTION:
+                handleNegotiation(verb, c);
+                state = STATE_DATA;
+                break;
+
+            case STATE_SB:
+                if (c == IAC)
+                {
+                    state = STATE_SB_IAC;
+                }
+                else if (subnegotiation.size() < MAX_SUBNEGOTIATION)
+                {
+                    subnegotiation += static_cast<char>(c);
+                }
+                continue;
+
+            case STATE_SB_IAC:
+                if (c == SE)
+                {
+                    handleSubnegotiation();
+                    state = STATE_DATA;
+                    break;
+                }
+
+                // IAC IAC inside SB is a data byte
+                if (c == IAC && subnegotiation.size() < MAX_SUBNEGOTIATION)
+                {
+                    subnegotiation += static_cast<char>(c);
+                }
+                state = STATE_SB;
+                continue;
+            }
+
+            // A command ended here, plain data starts after it
+            runStart = i + 1;
+        }
+
+        if (state == STATE_DATA && length > runStart)
+        {
+            return onData(data + runStart, length - runStart);
+        }
+        return true;
+    }
+
+    // Bytes marking the end of a reply, so clients can tell where a prompt is.
+    // Empty for clients that don't speak telnet.
+    std::string promptMark() const
+    {
+        if (localEnabled[OPT_EOR])
+        {
+            return std::string() + static_cast<char>(IAC) + static_cast<char>(EOR_MARK);
+        }
+        if (telnetSeen && !localEnabled[OPT_SGA])
+        {
+            return std::string() + static_cast<char>(IAC) + static_cast<char>(GA);
+        }
+        return "";
+    }
+
+    bool isLocalEnabled(unsigned char option) const { return localEnabled[option]; }
+    bool isRemoteEnabled(unsigned char option) const { return remoteEnabled[option]; }
+
+    // Window size from NAWS, 0 if the client never sent one
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    const std::string& getTerminalType() const { return terminalType; }
+
+private:
+    enum State { STATE_DATA, STATE_IAC, STATE_OPTION, STATE_SB, STATE_SB_IAC };
+
+    static const size_t MAX_SUBNEGOTIATION = 256;
+
+    // Options we agree to enable on our side and ask the client to enable on theirs
+    bool supportsLocal(unsigned char option) const
+    {
+        return option == OPT_EOR || option == OPT_SGA || (option == OPT_COMPRESS2 && compressionAllowed);
+    }
+
+    static bool supportsRemote(unsigned char option)
+    {
+        return option == OPT_NAWS || option == OPT_TTYPE;
+    }
+
+    void sendCommand(unsigned char command, unsigned char option)
+    {
+        std::string bytes;
+        bytes += static_cast<char>(IAC);
+        bytes += static_cast<char>(command);
+        bytes += static_cast<char>(option);
+        sendRaw(bytes);
+    }
+
+    // Only answer requests that change something, so two sides can't loop (RFC 1143)
+    void handleNegotiation(unsigned char command, unsigned char option)
+    {
+        if (command == WILL || command == WONT)
+        {
+            bool wanted = command == WILL && supportsRemote(option);
+            bool asked = remotePending[option];
+            remotePending[option] = false;
+            if (wanted != remoteEnabled[option])
+            {
+                remoteEnabled[option] = wanted;
+                if (!asked || !wanted)
+                {
+                    sendCommand(wanted ? DO : DONT, option);
+                }
+                remoteChanged(option, wanted);
+            }
+            else if (command == WILL && !wanted)
+            {
+                sendCommand(DONT, option);
+            }
+        }
+        else
+        {
+            bool wanted = command == DO && supportsLocal(option);
+            bool asked = localPending[option];
+            localPending[option] = false;
+            if (wanted != localEnabled[option])
+            {
+                localEnabled[option] = wanted;
+                if (!asked || !wanted)
+                {
+                    sendCommand(wanted ? WILL : WONT, option);
+                }
+                if (onOption)
+                {
+                    onOption(option, true, wanted);
+                }
+            }
+            else if (command == DO && !wanted)
+            {
+                sendCommand(WONT, option);
+            }
+        }
+    }
+
+    void remoteChanged(unsigned char option, bool enabled)
+    {
+        if (enabled && option == OPT_TTYPE)
+        {
+            // The terminal type is only sent when asked for
+            std::string bytes;
+            bytes += static_cast<char>(IAC);
+            bytes += static_cast<char>(SB);
+            bytes += static_cast<char>(OPT_TTYPE);
+            bytes += static_cast<char>(TTYPE_SEND);
+            bytes += static_cast<char>(IAC);
+            bytes += static_cast<char>(SE);
+            sendRaw(bytes);
+        }
+        if (onOption)
+        {
+            onOption(option, false, enabled);
+        }
+    }
+
+    void handleSubnegotiation()
+    {
+        if (subnegotiation.empty())
+        {
+            return;
+        }
+
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(subnegotiation.data());
+        unsigned char option = bytes[0];
+        if (option == OPT_NAWS && subnegotiation.size() >= 5)
+        {
+            width = (bytes[1] << 8) | bytes[2];
+            height = (bytes[3] << 8) | bytes[4];
+        }
+        else if (option == OPT_TTYPE && subnegotiation.size() >= 2 && bytes[1] == TTYPE_IS)
+        {
+            terminalType = subnegotiation.substr(2);
+        }
+    }
+
+    RawSender sendRaw;
+    OptionListener onOption;
+    bool compressionAllowed;
+
+    State state;
+    unsigned char verb;  // WILL/WONT/DO/DONT waiting for its option byte
+    std::string subnegotiation;  // SB payload so far, without the IAC SB / IAC SE
+    bool telnetSeen;  // the client has sent at least one IAC
+
+    bool localEnabled[256];
+    bool remoteEnabled[256];
+    bool localPending[256];  // we sent WILL and wait for DO/DONT
+    bool remotePending[256];  // we sent DO and wait for WILL/WONT
+
+    int width;
+    int height;
+    std::string terminalType;
+};
+
+#endif //TELNETPROTOCOL_H
@@ -1,6 +1,7 @@
 #ifndef TELNETSERVER_H
 #define TELNETSERVER_H
 
+#include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <ostream>
@@ -13,74 +14,82 @@
 #include <mutex>
 
 #include "SocketUtils.h"
+#include "CommandExecutor.h"
 #include "TelnetClientHandler.h"
+#include "EpollEventLoop.h"
+#include "IoUringEventLoop.h"
+#include "ServerConfig.h"
 #include "Game.h"
 
 class TelnetServer
 {
 public:
-    TelnetServer() : serverSocket(-1), running(false) {}
+    TelnetServer() : running(false) {}
 
-    bool start(int port)
+    bool start(const ServerConfig& config)
     {
-        // Create a socket.
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket < 0)
-        {
-            perror("socket");
-            return false;
-        }
-
-        // Set socket options
-        int opt = 1;
-        if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+        int port = config.port;
+        auto startTime = std::chrono::steady_clock::now();
+
+        // Load users and mail side by side. Nothing listens on the port until both are
+        // loaded, so clients are refused rather than served from half-loaded data.
+        std::thread messageLoader([]() { MessageManager::getInstance(); });
+        UserManager::getInstance();
+        messageLoader.join();
+        auto loadedTime = std::chrono::steady_clock::now();
+
+        // Pick how changes to the saved data reach the disk
+        WriteAheadLog::Durability durability = WriteAheadLog::BATCH;
+        WriteAheadLog::parseDurability(config.durability, durability);
+        UserManager::getInstance().setDurability(durability, config.commitWindowMs);
+        MessageManager::getInstance().setDurability(durability, config.commitWindowMs);
+
+        // Commands run on the executor's workers, so it starts before any client connects
+        executor.reset(new CommandExecutor(config.resolvedWorkers()));
+        executor->start();
+
+        // Start the event loops that own the client connections
+        int loopCount = config.resolvedIoThreads();
+        for (int i = 0; i < loopCount; i++)
         {
-            perror("setsockopt");
-            close(serverSocket);
-            return false;
+            std::unique_ptr<EventLoop> loop = createEventLoop(config, i);
+            if (!loop)
+            {
+                loops.clear();
+                return false;
+            }
+            loops.push_back(std::move(loop));
         }
 
-        // Socket binding address info
-        struct sockaddr_in serverAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;  // IPv4
-        serverAddr.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces
-        serverAddr.sin_port = htons(port);  // Convert from host byte order to network byte order
-
-        // Bind the socket to a local address and port number
-        if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
+        // Every loop gets its own SO_REUSEPORT listening socket. The kernel spreads
+        // incoming connections over them and each loop keeps what it accepts, so no
+        // connection waits on another loop.
+        for (auto& loop : loops)
         {
-            // If failed, close socket and return error
-            perror("bind");
-            close(serverSocket);
-            return false;
-        }
-
-        if (listen(serverSocket, 10) < 0) {
-            perror("listen");
-            close(serverSocket);
-            return false;
-        }
+            int listenSocket = openListener(port, config.backlog);
+            if (listenSocket < 0)
+            {
+                loops.clear();
+                closeListeners();
+                return false;
+            }
+            listenSockets.push_back(listenSocket);
 
-        // Set the server to non-blocking mode
-        if (!SocketUtils::setNonBlocking(serverSocket))
-        {
-            close(serverSocket);
-            return false;
+            EventLoop* owner = loop.get();
+            CommandExecutor* commands = executor.get();
+            owner->addListener(listenSocket, [owner, commands, config](int clientSocket) {
+                acceptConnection(owner, commands, clientSocket, config);
+            });
         }
 
         running = true;
 
-        // Start the thread to accept new connections
-        acceptThread = std::thread(&TelnetServer::acceptConnections, this);
-
-        // Start the game cleanup thread
-        cleanupThread = std::thread(&TelnetServer::cleanupGames, this);
-
-        // Start the game timeout checking thread
-        gameTimeoutThread = std::thread(&TelnetServer::checkGameTimeouts, this);
-
-        std::cout << "Gomoku server started on port " << port << std::endl;
+        std::cout << "Gomoku server started on port " << port << " with " << loopCount << " "
+                  << loops[0]->getBackendName() << " event loop threads and " << executor->getWorkerCount()
+                  << " command workers (backlog " << config.backlog << ")" << std::endl;
+        std::cout << "Ready in " << millisecondsSince(startTime) << " ms (data loaded in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(loadedTime - startTime).count() << " ms)"
+                  << std::endl;
         return true;
     }
 
@@ -88,30 +97,21 @@ public:
     {
         running = false;
 
-        if (acceptThread.joinable())
-        {
-            acceptThread.join();
-        }
-
-        if (cleanupThread.joinable())
+        // Stop the loops first so no command is queued while clients are torn down,
+        // then let the workers finish the commands already queued
+        for (auto& loop : loops)
         {
-            cleanupThread.join();
+            loop->stop();
         }
-
-        if (gameTimeoutThread.joinable())
+        if (executor)
         {
-            gameTimeoutThread.join();
+            executor->stop();
         }
 
+        // Disconnect all clients
+        for (auto& loop : loops)
         {
-            std::lock_guard<std::mutex> lock(mutex);
-
-            // Disconnect all clients
-            for (auto& client : clients)
-            {
-                client->disconnect();
-            }
-            clients.clear();
+            loop->disconnectAll();
         }
 
         // Save user data and messages before stopping
@@ -123,170 +123,144 @@ public:
         MessageManager::getInstance().saveMessages();
         std::cout << "Message data saved successfully" << std::endl;
 
-        if (serverSocket >= 0)
-        {
-            close(serverSocket);
-            serverSocket = -1;
-        }
+        closeListeners();
 
+        std::cout << UserManager::getInstance().getLockStats() << "\n"
+                  << GameManager::getInstance().getLockStats() << std::endl;
         std::cout << "Server stopped" << std::endl;
     }
 
     void broadcastMessage(const std::string& msg, const std::string& excludeUsername = "")
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (auto& client : clients)
+        // Formatted once, every recipient queues the same buffer
+        OutboundChannel::Buffer buffer = SocketUtils::makeBuffer(msg + "\r\n");
+
+        // Each loop sends to the clients it owns
+        for (auto& loop : loops)
         {
-            if (client->isLoggedIn() && client->getUsername() != excludeUsername)
-            {
-                // Check if user is in quiet mode
-                auto user = UserManager::getInstance().getUserByUsername(client->getUsername());
-                if (user && !user->isInQuietMode())
-                {
-                    client->sendMessage(msg);
-                }
-            }
+            EventLoop* owner = loop.get();
+            owner->post([owner, buffer, excludeUsername]() {
+                owner->forEachClient([&](const std::shared_ptr<TelnetClientHandler>& client) {
+                    // A worker may be logging the client in or out, so its session isn't read here
+                    auto user = UserManager::getInstance().getUserBySocket(client->getSocket());
+                    if (user && user->getUsername() != excludeUsername && !user->isInQuietMode())
+                    {
+                        client->getChannel()->send(buffer, true);
+                    }
+                });
+            });
         }
     }
 
 private:
-    void acceptConnections()
+    // Build one event loop on the configured backend, falling back to epoll when
+    // the kernel can't run io_uring
+    static std::unique_ptr<EventLoop> createEventLoop(const ServerConfig& config, int index)
     {
-        while (running)
+        std::unique_ptr<EventLoop> loop;
+        if (config.ioBackend == "uring")
         {
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrLen = sizeof(clientAddr);
-
-            // non-blocking accept
-            int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-
-            if (clientSocket < 0)
+            loop.reset(new IoUringEventLoop(index));
+            loop->setIdleTimeout(config.idleTimeout);
+            if (!loop->start())
             {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // No pending connections so sleep a bit
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    continue;
-                }
-                else
-                {
-                    perror("accept");
-                    continue;
-                }
+                std::cerr << "io_uring not available, falling back to epoll" << std::endl;
+                loop.reset();
             }
+        }
 
-            // Set to non-blocking mode
-            if (!SocketUtils::setNonBlocking(clientSocket))
+        if (!loop)
+        {
+            loop.reset(new EpollEventLoop(index));
+            loop->setIdleTimeout(config.idleTimeout);
+            if (!loop->start())
             {
-                close(clientSocket);
-                continue;
+                return nullptr;
             }
-
-            // Create client handler
-            std::lock_guard<std::mutex> lock(mutex);
-            clients.push_back(std::make_shared<TelnetClientHandler>(clientSocket));
-
-            // Log connection
-            char clientIP[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
-            std::cout << "New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << std::endl;
         }
+        return loop;
+    }
+
+    static long long millisecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
     }
 
-    void cleanupGames()
+    static int openListener(int port, int backlog)
     {
-        // Save messages every 5 minutes (300 seconds)
-        const int SAVE_INTERVAL = 300;
-        time_t lastSaveTime = time(nullptr);
-        while (running)
+        // Create a socket.
+        int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenSocket < 0)
         {
-            time_t currentTime = time(nullptr);
+            perror("socket");
+            return -1;
+        }
 
-            // Clean up finished games
-            GameManager::getInstance().cleanupGames();
+        // Set socket options, SO_REUSEPORT lets every loop bind the same port
+        int opt = 1;
+        if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        {
+            perror("setsockopt");
+            close(listenSocket);
+            return -1;
+        }
 
-            // Check for disconnected clients
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                auto it = clients.begin();
-                while (it != clients.end())
-                {
-                    if (!(*it)->isConnected())
-                    {
-                        it = clients.erase(it);
-                    }
-                    else
-                    {
-                        ++it;
-                    }
-                }
-            }
+        // Socket binding address info
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;  // IPv4
+        serverAddr.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces
+        serverAddr.sin_port = htons(port);  // Convert from host byte order to network byte order
 
-            // Periodically save messages
-            if (currentTime - lastSaveTime >= SAVE_INTERVAL) {
-                std::cout << "Periodic message save..." << std::endl;
-                MessageManager::getInstance().saveMessages();
-                lastSaveTime = currentTime;
-            }
+        // Bind the socket to a local address and port number
+        if (bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
+        {
+            // If failed, close socket and return error
+            perror("bind");
+            close(listenSocket);
+            return -1;
+        }
 
-            // Sleep for a while
-            std::this_thread::sleep_for(std::chrono::seconds(30));
+        if (listen(listenSocket, backlog) < 0) {
+            perror("listen");
+            close(listenSocket);
+            return -1;
         }
+
+        return listenSocket;
     }
 
-    void checkGameTimeouts()
+    void closeListeners()
     {
-        while (running)
+        for (int listenSocket : listenSockets)
         {
-            auto games = GameManager::getInstance().getAllGames();
+            close(listenSocket);
+        }
+        listenSockets.clear();
+    }
 
-            for (auto& game : games)
-            {
-                if (game->getStatus() == GameStatus::PLAYING)
-                {
-                    if (game->checkTimeExpired())
-                    {
-                        // A game has ended due to timeout
-                        std::cout << "Game " << game->getId() << " ended due to timeout" << std::endl;
-
-                        // Notify players
-                        std::string timeoutMsg = "Game ended: " + game->getWinner() + " wins due to timeout.";
-
-                        auto blackPlayer = game->getBlackPlayer();
-                        auto whitePlayer = game->getWhitePlayer();
-
-                        if (blackPlayer->getSocket() != -1)
-                        {
-                            SocketUtils::sendData(blackPlayer->getSocket(), timeoutMsg + "\r\n");
-                        }
-
-                        if (whitePlayer->getSocket() != -1)
-                        {
-                            SocketUtils::sendData(whitePlayer->getSocket(), timeoutMsg + "\r\n");
-                        }
-
-                        // Notify observers
-                        for (int observerSocket : game->getObservers())
-                        {
-                            SocketUtils::sendData(observerSocket, timeoutMsg + "\r\n");
-                        }
-                    }
-                }
-            }
+    // Runs on the loop that accepted the already non-blocking socket, which keeps it
+    static void acceptConnection(EventLoop* loop, CommandExecutor* executor, int clientSocket, const ServerConfig& config)
+    {
+        loop->addClient(std::make_shared<TelnetClientHandler>(clientSocket, config, executor));
 
-            // Check every second
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+        // Log connection
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        if (getpeername(clientSocket, (struct sockaddr*)&clientAddr, &clientAddrLen) == 0)
+        {
+            char clientIP[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
+            std::cout << "New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << std::endl;
         }
     }
 
 private:
-    int serverSocket;
+    std::vector<int> listenSockets;
     std::atomic<bool> running;
-    std::thread acceptThread;
-    std::thread cleanupThread;
-    std::thread gameTimeoutThread;
-    std::vector<std::shared_ptr<TelnetClientHandler>> clients;
-    std::mutex mutex;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::unique_ptr<CommandExecutor> executor;
 };
 
 #endif //TELNETSERVER_H
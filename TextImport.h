@@ -0,0 +1,202 @@
+#ifndef TEXTIMPORT_H
+#define TEXTIMPORT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Helpers for reading the old text save files fast: the file is mapped instead of
+// read, split into chunks at record boundaries (a line such as USER_BEGIN) and the
+// chunks are parsed on all cores. Lines are string_views into the mapping, so
+// parsing only allocates for the values it keeps.
+namespace TextImport
+{
+    // A whole file mapped read-only, empty if it couldn't be opened
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& path) : base(nullptr), length(0), found(false)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return;
+            }
+            found = true;
+
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0)
+            {
+                void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED)
+                {
+                    base = static_cast<const char*>(mapped);
+                    length = static_cast<size_t>(info.st_size);
+                    madvise(mapped, length, MADV_SEQUENTIAL);
+                }
+                else
+                {
+                    perror(("mmap " + path).c_str());
+                }
+            }
+            close(fd);
+        }
+
+        ~MappedFile()
+        {
+            if (base)
+            {
+                munmap(const_cast<char*>(base), length);
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool exists() const { return found; }
+        std::string_view data() const { return std::string_view(base ? base : "", length); }
+
+    private:
+        const char* base;
+        size_t length;
+        bool found;
+    };
+
+    // Take the next line off text, without its line end
+    inline std::string_view nextLine(std::string_view& text)
+    {
+        size_t end = text.find('\n');
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+        return line;
+    }
+
+    // Offset of the first line equal to marker at or after from, npos if none
+    inline size_t findLine(std::string_view text, std::string_view marker, size_t from)
+    {
+        while (from < text.size())
+        {
+            size_t at = text.find(marker, from);
+            if (at == std::string_view::npos)
+            {
+                return at;
+            }
+            size_t after = at + marker.size();
+            if ((at == 0 || text[at - 1] == '\n') && (after == text.size() || text[after] == '\n' || text[after] == '\r'))
+            {
+                return at;
+            }
+            from = after;
+        }
+        return std::string_view::npos;
+    }
+
+    // Split text into about parts chunks, each starting at a marker line. header gets
+    // whatever comes before the first marker.
+    inline std::vector<std::string_view> splitChunks(std::string_view text, std::string_view marker, size_t parts,
+                                                     std::string_view& header)
+    {
+        std::vector<std::string_view> chunks;
+        size_t start = findLine(text, marker, 0);
+        header = text.substr(0, start == std::string_view::npos ? text.size() : start);
+        if (start == std::string_view::npos)
+        {
+            return chunks;
+        }
+
+        size_t target = (text.size() - start) / (parts > 0 ? parts : 1) + 1;
+        while (start < text.size())
+        {
+            size_t next = findLine(text, marker, start + target);
+            if (next == std::string_view::npos)
+            {
+                next = text.size();
+            }
+            chunks.push_back(text.substr(start, next - start));
+            start = next;
+        }
+        return chunks;
+    }
+
+    // Run parse(chunk, results) for every chunk on its own thread and join the
+    // results in file order
+    template <typename T, typename Parse>
+    std::vector<T> parseParallel(const std::vector<std::string_view>& chunks, Parse parse)
+    {
+        std::vector<std::vector<T>> partial(chunks.size());
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < chunks.size(); i++)
+        {
+            workers.emplace_back([&, i]() { parse(chunks[i], partial[i]); });
+        }
+        if (!chunks.empty())
+        {
+            parse(chunks[0], partial[0]);
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+
+        size_t total = 0;
+        for (const auto& part : partial)
+        {
+            total += part.size();
+        }
+        std::vector<T> results;
+        results.reserve(total);
+        for (auto& part : partial)
+        {
+            for (auto& item : part)
+            {
+                results.push_back(std::move(item));
+            }
+        }
+        return results;
+    }
+
+    inline size_t workerCount()
+    {
+        unsigned int cores = std::thread::hardware_concurrency();
+        return cores > 0 ? cores : 1;
+    }
+
+    // Parse a whole field as a number, value is left alone if it isn't one
+    template <typename T>
+    bool parseNumber(std::string_view text, T& value)
+    {
+        T parsed;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+        {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+    // Value of a "lsn=N" line in the text before the first record, 0 if there is none
+    inline unsigned long long headerLsn(std::string_view header)
+    {
+        unsigned long long lsn = 0;
+        while (!header.empty())
+        {
+            std::string_view line = nextLine(header);
+            if (line.substr(0, 4) == "lsn=")
+            {
+                parseNumber(line.substr(4), lsn);
+            }
+        }
+        return lsn;
+    }
+}
+
+#endif //TEXTIMPORT_H
@@ -0,0 +1,261 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+// Hierarchical timing wheel (Varghese & Lauck) on the monotonic clock. Four levels of
+// 64 slots: the first covers 64 ticks, each further level 64 times the one below, and
+// timers move down a level as their time approaches. Scheduling and cancelling are O(1),
+// and advancing costs one slot per tick plus the timers that fire. Not thread safe,
+// each event loop owns one.
+class TimingWheel
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef uint64_t TimerId;  // 0 is never a valid id
+    typedef std::function<void()> Callback;
+
+    explicit TimingWheel(Clock::duration tick = std::chrono::milliseconds(10))
+        : tick(tick), startTime(Clock::now()), currentTick(0), nextId(1)
+    {
+        for (int level = 0; level < LEVELS; level++)
+        {
+            occupied[level] = 0;
+            for (int slot = 0; slot < SLOTS; slot++)
+            {
+                Node& head = slots[level][slot];
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    // Run callback once delay has passed, rounded up to the next tick
+    TimerId schedule(Clock::duration delay, Callback callback)
+    {
+        Clock::time_point deadline = Clock::now() + delay;
+        uint64_t expireTick = static_cast<uint64_t>((deadline - startTime + tick - Clock::duration(1)) / tick);
+        if (expireTick <= currentTick)
+        {
+            expireTick = currentTick + 1;
+        }
+
+        std::unique_ptr<Node> node(new Node());
+        node->id = nextId++;
+        node->expireTick = expireTick;
+        node->callback = std::move(callback);
+
+        TimerId id = node->id;
+        insert(node.get());
+        timers[id] = std::move(node);
+        return id;
+    }
+
+    // Returns false if the timer already fired or was cancelled
+    bool cancel(TimerId id)
+    {
+        auto it = timers.find(id);
+        if (it == timers.end())
+        {
+            return false;
+        }
+        unlink(it->second.get());
+        timers.erase(it);
+        return true;
+    }
+
+    // Fire every timer that is due by now
+    void advance(Clock::time_point now = Clock::now())
+    {
+        uint64_t targetTick = now < startTime ? 0 : static_cast<uint64_t>((now - startTime) / tick);
+        while (currentTick < targetTick && !timers.empty())
+        {
+            currentTick++;
+            int slot = static_cast<int>(currentTick & SLOT_MASK);
+            if (slot == 0)
+            {
+                cascade(1);
+            }
+            fireSlot(slot);
+        }
+
+        // Nothing left to fire, skip the empty ticks
+        if (currentTick < targetTick)
+        {
+            currentTick = targetTick;
+        }
+    }
+
+    // Milliseconds until advance() has something to do, -1 when no timer is set
+    int nextTimeoutMs(Clock::time_point now = Clock::now()) const
+    {
+        if (timers.empty())
+        {
+            return -1;
+        }
+
+        // First occupied slot of the bottom level after the current one, or the
+        // next wrap, where the level above cascades down
+        uint64_t ticksAhead = SLOTS - (currentTick & SLOT_MASK);
+        if (occupied[0])
+        {
+            int shift = static_cast<int>((currentTick + 1) & SLOT_MASK);
+            uint64_t rotated = (occupied[0] >> shift) | (shift ? occupied[0] << (SLOTS - shift) : 0);
+            uint64_t next = static_cast<uint64_t>(__builtin_ctzll(rotated)) + 1;
+            if (next < ticksAhead || !hasUpperTimers())
+            {
+                ticksAhead = next;
+            }
+        }
+
+        Clock::time_point due = startTime + tick * static_cast<Clock::rep>(currentTick + ticksAhead);
+        if (due <= now)
+        {
+            return 0;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - now + std::chrono::milliseconds(1) -
+                                                                         Clock::duration(1));
+        return static_cast<int>(wait.count());
+    }
+
+    size_t size() const { return timers.size(); }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    struct Node
+    {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        TimerId id = 0;
+        uint64_t expireTick = 0;
+        int level = -1;  // -1 while not in a wheel slot
+        int slot = 0;
+        Callback callback;
+    };
+
+    bool hasUpperTimers() const
+    {
+        return (occupied[1] | occupied[2] | occupied[3]) != 0;
+    }
+
+    // Put a node in the slot of the level its remaining time falls in
+    void insert(Node* node)
+    {
+        uint64_t delta = node->expireTick - currentTick;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+        {
+            level++;
+        }
+
+        // Beyond the top level: park in its furthest slot, it cascades down again later
+        uint64_t expire = node->expireTick;
+        uint64_t maxDelta = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+        if (delta > maxDelta)
+        {
+            expire = currentTick + maxDelta;
+        }
+
+        int slot = static_cast<int>((expire >> (SLOT_BITS * level)) & SLOT_MASK);
+        Node& head = slots[level][slot];
+        node->level = level;
+        node->slot = slot;
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    void unlink(Node* node)
+    {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        if (node->level >= 0)
+        {
+            Node& head = slots[node->level][node->slot];
+            if (head.next == &head)
+            {
+                occupied[node->level] &= ~(1ULL << node->slot);
+            }
+        }
+        node->prev = node->next = node;
+        node->level = -1;
+    }
+
+    // Move the timers of the level's current slot down to where they now belong
+    void cascade(int level)
+    {
+        if (level >= LEVELS)
+        {
+            return;
+        }
+
+        int slot = static_cast<int>((currentTick >> (SLOT_BITS * level)) & SLOT_MASK);
+        if (slot == 0)
+        {
+            cascade(level + 1);
+        }
+
+        Node& head = slots[level][slot];
+        while (head.next != &head)
+        {
+            Node* node = head.next;
+            unlink(node);
+            insert(node);
+        }
+    }
+
+    void fireSlot(int slot)
+    {
+        // Detach the slot first, callbacks may schedule or cancel timers
+        Node& head = slots[0][slot];
+        Node due;
+        due.prev = due.next = &due;
+        if (head.next != &head)
+        {
+            due.next = head.next;
+            due.prev = head.prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head.prev = head.next = &head;
+            occupied[0] &= ~(1ULL << slot);
+            for (Node* node = due.next; node != &due; node = node->next)
+            {
+                node->level = -1;
+            }
+        }
+
+        while (due.next != &due)
+        {
+            Node* node = due.next;
+            unlink(node);
+
+            auto it = timers.find(node->id);
+            Callback callback = std::move(node->callback);
+            timers.erase(it);
+            callback();
+        }
+    }
+
+    Clock::duration tick;
+    Clock::time_point startTime;
+    uint64_t currentTick;
+    TimerId nextId;
+
+    Node slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS];  // bit per non-empty slot
+    std::unordered_map<TimerId, std::unique_ptr<Node>> timers;
+};
+
+#endif //TIMINGWHEEL_H
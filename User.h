@@ -5,15 +5,23 @@
 #include <vector>
 #include <unordered_set>
 #include <mutex>
+#include <shared_mutex>
 #include <unordered_map>
-#include <fstream>
 #include <filesystem>
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <sstream>
+
+#include "StripedMap.h"
+#include "TextImport.h"
+#include "UserIds.h"
+#include "UserStore.h"
+#include "WriteAheadLog.h"
 
 class User {
 private:
+    UserId id;
     std::string username;
     std::string password;
     std::string info;
@@ -21,25 +29,29 @@ private:
     int losses;
     float rating;
     bool isQuiet;
-    std::unordered_set<std::string> blockedUsers;
+    std::unordered_set<UserId> blockedUsers;
     std::mutex userMutex;
     int clientSocket;
     bool isGuest;
-    bool isPlaying;
-    bool isObserving;
-    int gameId;
+    // what the user plays or watches, changed by game strands on other threads too
+    std::atomic<bool> isPlaying;
+    std::atomic<bool> isObserving;
+    std::atomic<int> gameId;
+    bool dirty; // saved fields changed since the last checkpoint
 
 public:
 
 
     User(const std::string& username, const std::string& password, int socket)
-        : username(username), password(password), info(""), wins(0), losses(0), rating(1500.0f),
+        : id(UserIds::getInstance().intern(username)), username(username), password(password), info(""),
+          wins(0), losses(0), rating(1500.0f),
           isQuiet(false), clientSocket(socket), isGuest(username == "guest"),
-          isPlaying(false), isObserving(false), gameId(-1) {
+          isPlaying(false), isObserving(false), gameId(-1), dirty(true) {
 
           }
 
     // Getters
+    UserId getId() const { return id; }
     std::string getPassword() const { return password; }
     std::string getUsername() const { return username; }
     std::string getInfo() const { return info; }
@@ -50,13 +62,14 @@ public:
     int getGameId() const { return gameId; }
 
     // setters
-    void setPassword(const std::string& pwd) { password = pwd; }
-    void setInfo(const std::string& newInfo) { info = newInfo; }
-    void setQuietMode(bool quiet) { isQuiet = quiet; }
+    void setPassword(const std::string& pwd) { password = pwd; dirty = true; }
+    void setInfo(const std::string& newInfo) { info = newInfo; dirty = true; }
+    void setQuietMode(bool quiet) { isQuiet = quiet; dirty = true; }
     void setSocket(int socket) { clientSocket = socket; }
     void setPlaying(bool playing) { isPlaying = playing; }
     void setObserving(bool observing) { isObserving = observing; }
     void setGameId(int id) { gameId = id; }
+    void setDirty(bool changed) { dirty = changed; }
 
     // Checks
     bool isInQuietMode() const { return isQuiet; }
@@ -64,30 +77,37 @@ public:
     bool isInGame() const { return isPlaying; }
     bool isUserObserving() const { return isObserving; }
     bool checkPassword(const std::string& pwd) const { return password == pwd; }
+    bool isDirty() const { return dirty; }
 
     // stats functions
-    void addWin() { wins++; updateRating(true); }
-    void addLoss() { losses++; updateRating(false); }
+    void addWin() { wins++; updateRating(true); dirty = true; }
+    void addLoss() { losses++; updateRating(false); dirty = true; }
+    void setStats(int newWins, int newLosses, float newRating) {
+        wins = newWins; losses = newLosses; rating = newRating; dirty = true;
+    }
 
     // blocking functions
-    void blockUser(const std::string& user) {
+    void blockUser(UserId user) {
         std::lock_guard<std::mutex> lock(userMutex);
         blockedUsers.insert(user);
+        dirty = true;
     }
 
-    void unblockUser(const std::string& user) {
+    void unblockUser(UserId user) {
         std::lock_guard<std::mutex> lock(userMutex);
         blockedUsers.erase(user);
+        dirty = true;
     }
 
-    bool isBlocked(const std::string& user) const {
+    bool isBlocked(UserId user) const {
         return blockedUsers.find(user) != blockedUsers.end();
     }
 
+    // Names of the blocked users, for saving
     std::vector<std::string> getBlockedUsers() const {
         std::vector<std::string> result;
-        for (const auto& user : blockedUsers) {
-            result.push_back(user);
+        for (UserId user : blockedUsers) {
+            result.push_back(UserIds::getInstance().name(user));
         }
         return result;
     }
@@ -106,18 +126,52 @@ private:
 // UserManager class
 class UserManager {
 private:
-    std::unordered_map<std::string, std::shared_ptr<User>> users;
-    std::unordered_map<int, std::string> socketToUser;
-    std::mutex usersMutex;
+    // Striped, so lookups on different loops don't queue on one lock
+    StripedMap<UserId, std::shared_ptr<User>> users;
+    StripedMap<int, std::shared_ptr<User>> socketToUser;
+    UserId guestId; // the account all guests share
+
+    // A change to a user and its log record are made under changesMutex, so the log
+    // has them in the order they happened; a checkpoint copies the changed users
+    // under it too. Lookups don't take it.
+    std::mutex changesMutex;
     std::thread autosaveThread;
     std::atomic<bool> running;
 
-    UserManager() : running(true) {
-        // create guest account
-        users["guest"] = std::make_shared<User>("guest", "", -1);
+    // Every change is appended to the log; users_data.bin is a snapshot of some point
+    // of it, brought up to date only by saveUsers(). Users are read from the snapshot
+    // when first looked up; from then on the copy in users is the current one.
+    UserStore store;
+    std::shared_mutex storeMutex;  // held shared to read store, exclusive to remap it
+    WriteAheadLog log;
+    std::mutex snapshotMutex;  // one snapshot at a time
 
-        // Load existing users
-        loadUsers();
+    // Users changed since the last checkpoint, so it doesn't have to look at the others
+    std::unordered_set<std::shared_ptr<User>> changedUsers;
+
+public:
+    // What a checkpoint wrote
+    struct CheckpointStats {
+        size_t records = 0;
+        size_t bytes = 0;
+        bool rewrite = false; // the whole file was rebuilt
+    };
+
+private:
+    CheckpointStats lastCheckpoint; // guarded by snapshotMutex
+
+    UserManager() : running(true), log("users_data.wal") {
+        // create guest account
+        auto guest = std::make_shared<User>("guest", "", -1);
+        guestId = guest->getId();
+        users.assign(guestId, guest);
+
+        // Load the last snapshot, then the changes made since
+        uint64_t snapshotLsn = loadUsers();
+        {
+            std::lock_guard<std::mutex> lock(changesMutex);
+            log.open(snapshotLsn, [this](uint64_t, const WriteAheadLog::Record& record) { applyRecord(record); });
+        }
 
         // Start autosave thread to run over course of program
         autosaveThread = std::thread(&UserManager::autosaveLoop, this);
@@ -138,6 +192,167 @@ private:
         }
     }
 
+    // The user called username, read from the snapshot on first use
+    std::shared_ptr<User> findUser(const std::string& username) {
+        UserId id = UserIds::getInstance().find(username);
+        std::shared_ptr<User> user;
+        if (id != UserIds::NONE && users.find(id, user)) {
+            return user;
+        }
+
+        UserStore::Entry entry;
+        {
+            std::shared_lock<std::shared_mutex> lock(storeMutex);
+            long index = store.find(username);
+            if (index < 0 || !store.entry(static_cast<uint32_t>(index), entry)) {
+                return nullptr;
+            }
+        }
+
+        user = std::make_shared<User>(entry.username, entry.password, -1);
+        user->setInfo(entry.info);
+        user->setStats(entry.wins, entry.losses, entry.rating);
+        user->setQuietMode(entry.quiet);
+        for (const auto& blockedUser : entry.blocked) {
+            user->blockUser(UserIds::getInstance().intern(blockedUser));
+        }
+        user->setDirty(false);
+
+        // Whoever read it first wins if two loops read it at once
+        users.insert(user->getId(), user);
+        return user;
+    }
+
+    std::shared_ptr<User> findUser(UserId id) {
+        std::shared_ptr<User> user;
+        return users.find(id, user) ? user : findUser(UserIds::getInstance().name(id));
+    }
+
+    // Redo one logged change, changesMutex held
+    void applyRecord(const WriteAheadLog::Record& record) {
+        if (record.size() < 3) {
+            return;
+        }
+        const std::string& type = record[0];
+        const std::string& name = record[1];
+
+        if (type == "register") {
+            if (!findUser(name)) {
+                auto user = std::make_shared<User>(name, record[2], -1);
+                users.assign(user->getId(), user);
+                changedUsers.insert(user);
+            }
+            return;
+        }
+
+        auto user = findUser(name);
+        if (!user) {
+            return;
+        }
+
+        if (type == "passwd") user->setPassword(record[2]);
+        else if (type == "info") user->setInfo(record[2]);
+        else if (type == "quiet") user->setQuietMode(record[2] == "1");
+        else if (type == "block") user->blockUser(UserIds::getInstance().intern(record[2]));
+        else if (type == "unblock") user->unblockUser(UserIds::getInstance().intern(record[2]));
+        else if (type == "stats" && record.size() >= 5) {
+            try {
+                user->setStats(std::stoi(record[2]), std::stoi(record[3]), std::stof(record[4]));
+            } catch (...) {
+                std::cerr << "Bad stats record for " << name << std::endl;
+            }
+        }
+        changedUsers.insert(user);
+    }
+
+    // Log the current stats of a user, changesMutex held
+    void logStats(const std::shared_ptr<User>& user) {
+        std::ostringstream rating;
+        rating << user->getRating();
+        log.append({"stats", user->getUsername(), std::to_string(user->getWins()),
+                    std::to_string(user->getLosses()), rating.str()});
+    }
+
+    static UserStore::Entry toEntry(const User& user) {
+        UserStore::Entry entry;
+        entry.username = user.getUsername();
+        entry.password = user.getPassword();
+        entry.info = user.getInfo();
+        entry.wins = user.getWins();
+        entry.losses = user.getLosses();
+        entry.rating = user.getRating();
+        entry.quiet = user.isInQuietMode();
+        entry.blocked = user.getBlockedUsers();
+        return entry;
+    }
+
+    // Build users_data.bin anew from all users, as of lsn or later. changesMutex is
+    // held only while the users in memory are copied; the rest are read from the store,
+    // which only the saver changes. snapshotMutex held.
+    bool rewriteUsers(uint64_t& lsn, size_t& records, size_t& bytes) {
+        std::vector<UserStore::Entry> entries;
+        {
+            std::lock_guard<std::mutex> lock(changesMutex);
+            lsn = log.lastLsn();
+            auto loaded = users.snapshot();
+            entries.reserve(store.size() + loaded.size());
+
+            // Users that were looked up are current in memory, the rest as in the last snapshot
+            for (const auto& pair : loaded) {
+                // Skip guest accounts
+                if (pair.first != guestId) {
+                    entries.push_back(toEntry(*pair.second));
+                }
+            }
+        }
+
+        // A user looked up after the copy is in the store as it was, later changes are in the log
+        std::unordered_set<std::string> copied;
+        for (const auto& entry : entries) {
+            copied.insert(entry.username);
+        }
+        UserStore::Entry entry;
+        for (uint32_t i = 0; i < store.size(); i++) {
+            if (store.entry(i, entry) && copied.find(entry.username) == copied.end()) {
+                entries.push_back(entry);
+            }
+        }
+
+        std::string file = UserStore::build(lsn, entries);
+        if (!WriteAheadLog::replaceFile("users_data.bin", file)) {
+            std::cerr << "Failed to write users_data.bin" << std::endl;
+            return false;
+        }
+        {
+            // The old mapping stays readable until it is replaced here
+            std::lock_guard<std::shared_mutex> lock(storeMutex);
+            store.open("users_data.bin");
+        }
+        records = entries.size();
+        bytes = file.size();
+        return true;
+    }
+
+    // Apply a change to a registered user and log it. Guests share one account that
+    // isn't saved.
+    bool changeUser(const std::string& username, const WriteAheadLog::Record& record,
+                    const std::function<void(User&)>& change) {
+        auto user = findUser(username);
+        if (!user) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(changesMutex);
+            change(*user);
+            if (user->getId() == guestId) {
+                return true;
+            }
+            changedUsers.insert(user);
+            log.append(record);
+        }
+        return true;
+    }
+
 public:
 
     ~UserManager() {
@@ -151,308 +366,300 @@ public:
         return instance;
     }
 
-    // User registration
-    bool registerUser(const std::string& username, const std::string& password, int socket) {
-        std::lock_guard<std::mutex> lock(usersMutex);
+    // How changes reach the disk, see WriteAheadLog
+    void setDurability(WriteAheadLog::Durability mode, int commitWindowMs) {
+        log.setDurability(mode, commitWindowMs);
+    }
+
+    // Run done once every change made so far is durable
+    void whenDurable(std::function<void()> done) {
+        log.whenDurable(log.lastLsn(), std::move(done));
+    }
+
+    // User registration, returns the new user or nullptr if the name is taken
+    std::shared_ptr<User> registerUser(const std::string& username, const std::string& password, int socket) {
+        std::lock_guard<std::mutex> lock(changesMutex);
 
         // Check if username already exists
-        if (users.find(username) != users.end()) {
-            return false;
+        if (findUser(username)) {
+            return nullptr;
         }
 
         // Create new user
-        users[username] = std::make_shared<User>(username, password, socket);
-        socketToUser[socket] = username;
+        auto user = std::make_shared<User>(username, password, socket);
+        users.assign(user->getId(), user);
+        socketToUser.assign(socket, user);
+        changedUsers.insert(user);
 
         // Save changes
-        saveUsers();
+        log.append({"register", username, password});
 
-        return true;
+        return user;
     }
 
-    // User login
-    bool loginUser(const std::string& username, const std::string& password, int socket) {
-        std::lock_guard<std::mutex> lock(usersMutex);
-
-        auto it = users.find(username);
-        if (it == users.end() || !it->second->checkPassword(password)) {
-            return false;
+    // User login, returns the user or nullptr if the name or password is wrong
+    std::shared_ptr<User> loginUser(const std::string& username, const std::string& password, int socket) {
+        auto user = findUser(username);
+        if (!user || !user->checkPassword(password)) {
+            return nullptr;
         }
 
         // Update socket
-        it->second->setSocket(socket);
-        socketToUser[socket] = username;
+        user->setSocket(socket);
+        socketToUser.assign(socket, user);
 
-        return true;
+        return user;
     }
 
-    bool loginGuest(int socket) {
-        std::lock_guard<std::mutex> lock(usersMutex);
-        socketToUser[socket] = "guest";
-        return true;
+    std::shared_ptr<User> loginGuest(int socket) {
+        auto guest = findUser(guestId);
+        socketToUser.assign(socket, guest);
+        return guest;
     }
 
     void logoutUser(int socket) {
-        std::lock_guard<std::mutex> lock(usersMutex);
-
-        auto it = socketToUser.find(socket);
-        if (it != socketToUser.end()) {
-            std::string username = it->second;
-            if (username != "guest" && users.find(username) != users.end()) {
-                users[username]->setSocket(-1); // Mark user as disconnected
-            }
-            socketToUser.erase(it);
+        std::shared_ptr<User> user;
+        if (socketToUser.erase(socket, user) && user->getId() != guestId) {
+            user->setSocket(-1); // Mark user as disconnected
         }
     }
 
     std::string getUsernameBySocket(int socket) {
-        std::lock_guard<std::mutex> lock(usersMutex);
-
-        auto it = socketToUser.find(socket);
-        if (it != socketToUser.end()) {
-            return it->second;
-        }
-        return "";
+        std::shared_ptr<User> user;
+        return socketToUser.find(socket, user) ? user->getUsername() : "";
     }
 
     std::shared_ptr<User> getUserByUsername(const std::string& username) {
-        std::lock_guard<std::mutex> lock(usersMutex);
+        return findUser(username);
+    }
 
-        auto it = users.find(username);
-        if (it != users.end()) {
-            return it->second;
-        }
-        return nullptr;
+    std::shared_ptr<User> getUserById(UserId id) {
+        return findUser(id);
     }
 
     std::shared_ptr<User> getUserBySocket(int socket) {
-        std::string username = getUsernameBySocket(socket);
-        if (!username.empty()) {
-            return getUserByUsername(username);
-        }
-        return nullptr;
+        std::shared_ptr<User> user;
+        return socketToUser.find(socket, user) ? user : nullptr;
     }
 
     std::vector<std::shared_ptr<User>> getOnlineUsers() {
-        std::lock_guard<std::mutex> lock(usersMutex);
-
         std::vector<std::shared_ptr<User>> result;
-        for (const auto& pair : socketToUser) {
-            std::string username = pair.second;
-            if (username != "guest" && users.find(username) != users.end()) {
-                result.push_back(users[username]);
+        for (const auto& pair : socketToUser.snapshot()) {
+            if (pair.second->getId() != guestId) {
+                result.push_back(pair.second);
             }
         }
         return result;
     }
 
 
+    // Write the users changed since the last checkpoint into users_data.bin and drop
+    // the log records it now covers. Only copying them holds the users lock, so the
+    // cost follows the activity rather than the number of accounts. When the file has
+    // no room for them it is rebuilt from all users instead.
     bool saveUsers()
     {
+        std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
         std::cout << "Attempting to save users data..." << std::endl;
 
-        // had problems with getting lock so use try_lock
-        if (!usersMutex.try_lock()) {
-            return false;
+        std::vector<std::shared_ptr<User>> changed;
+        std::vector<UserStore::Entry> entries;
+        uint64_t lsn;
+        {
+            std::lock_guard<std::mutex> lock(changesMutex);
+            lsn = log.lastLsn();
+            for (const auto& user : changedUsers) {
+                if (user->isDirty()) {
+                    entries.push_back(toEntry(*user));
+                    user->setDirty(false);
+                    changed.push_back(user);
+                }
+            }
+            changedUsers.clear();
+        }
+
+        if (entries.empty() && store.isOpen() && lsn == store.getLsn()) {
+            std::cout << "User data unchanged since the last save" << std::endl;
+            return true;
         }
 
-        try {
-            // Open file for writing
-            std::ofstream file("users_data.txt");
-            if (!file.is_open()) {
-                std::cerr << "Failed to open users_data.txt for writing" << std::endl;
-                usersMutex.unlock();
+        CheckpointStats stats;
+        stats.records = entries.size();
+        if (!store.isOpen() || !store.update(lsn, entries, storeMutex, stats.bytes)) {
+            stats.rewrite = true;
+            if (!rewriteUsers(lsn, stats.records, stats.bytes)) {
+                // Try again next time
+                std::lock_guard<std::mutex> lock(changesMutex);
+                for (const auto& user : changed) {
+                    user->setDirty(true);
+                    changedUsers.insert(user);
+                }
                 return false;
             }
+        }
+        log.truncateThrough(lsn);
+        lastCheckpoint = stats;
 
-            int userCount = 0;
-            // Write each user
-            for (const auto& pair : users) {
-                const auto& user = pair.second;
+        std::cout << "User data saved successfully: " << stats.records << " records, " << stats.bytes
+                  << " bytes written" << (stats.rewrite ? " (file rebuilt)" : "") << std::endl;
+        return true;
+    }
 
-                // Skip guest accounts
-                if (user->getUsername() == "guest") {
-                    continue;
-                }
+    CheckpointStats getLastCheckpoint() {
+        std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+        return lastCheckpoint;
+    }
 
-                userCount++;
-                file << "USER_BEGIN\n";
-                file << "username=" << user->getUsername() << "\n";
-                file << "password=" << user->getPassword() << "\n";
-                file << "info=" << user->getInfo() << "\n";
-                file << "wins=" << user->getWins() << "\n";
-                file << "losses=" << user->getLosses() << "\n";
-                file << "rating=" << user->getRating() << "\n";
-                file << "quiet=" << (user->isInQuietMode() ? "1" : "0") << "\n";
-
-                // Write blocked users
-                file << "blocked_begin\n";
-                for (const auto& blockedUser : user->getBlockedUsers()) {
-                    file << blockedUser << "\n";
-                }
-                file << "blocked_end\n";
+    // Open the last snapshot, returns the lsn of the last log record it includes.
+    // A users_data.txt from before the binary format is converted once.
+    uint64_t loadUsers() {
+        std::lock_guard<std::shared_mutex> lock(storeMutex);
 
-                file << "USER_END\n";
-            }
+        if (store.open("users_data.bin")) {
+            std::cout << "Opened " << store.size() << " user accounts from save." << std::endl;
+            return store.getLsn();
+        }
 
-            file.flush();
-            file.close();
-            std::cout << "User data saved successfully: " << userCount << " users written" << std::endl;
-            usersMutex.unlock();
-            return true;
+        std::vector<UserStore::Entry> entries;
+        uint64_t snapshotLsn = 0;
+        if (!loadTextUsers(entries, snapshotLsn)) {
+            std::cout << "No user data file found. Starting with fresh user database." << std::endl;
+            return 0;
         }
-        catch (const std::exception& e) {
-            std::cerr << "Error saving users: " << e.what() << std::endl;
-            usersMutex.unlock();
-            return false;
+
+        if (!WriteAheadLog::replaceFile("users_data.bin", UserStore::build(snapshotLsn, entries)) ||
+            !store.open("users_data.bin")) {
+            std::cerr << "Failed to convert users_data.txt to users_data.bin" << std::endl;
+            return 0;
         }
+        std::cout << "Converted " << entries.size() << " user accounts from users_data.txt to users_data.bin" << std::endl;
+        return snapshotLsn;
     }
 
-    void loadUsers() {
-        std::lock_guard<std::mutex> lock(usersMutex);
+    // Read the old text format, false if there is no such file. The file is split at
+    // USER_BEGIN lines and the pieces are parsed in parallel.
+    static bool loadTextUsers(std::vector<UserStore::Entry>& entries, uint64_t& snapshotLsn) {
+        TextImport::MappedFile file("users_data.txt");
+        if (!file.exists()) {
+            return false;
+        }
+
+        std::string_view header;
+        std::vector<std::string_view> chunks =
+            TextImport::splitChunks(file.data(), "USER_BEGIN", TextImport::workerCount(), header);
+        snapshotLsn = TextImport::headerLsn(header);
+        entries = TextImport::parseParallel<UserStore::Entry>(chunks, parseTextUsers);
+        return true;
+    }
 
-        try {
-            // Try to open the file
-            std::ifstream file("users_data.txt");
-            if (!file.is_open()) {
-                std::cout << "No user data file found. Starting with fresh user database." << std::endl;
-                return;
+    // Parse the users in one piece of users_data.txt
+    static void parseTextUsers(std::string_view text, std::vector<UserStore::Entry>& entries) {
+        UserStore::Entry user;
+        bool inBlockedSection = false;
+        bool inUserSection = false;
+
+        while (!text.empty()) {
+            std::string_view line = TextImport::nextLine(text);
+            if (line == "USER_BEGIN") {
+                inUserSection = true;
+                user = UserStore::Entry();
+                user.wins = user.losses = 0;
+                user.rating = 1500.0f;
+                user.quiet = false;
+                continue;
             }
-
-            std::string line;
-            std::string username, password, info;
-            int wins = 0, losses = 0;
-            float rating [[maybe_unused]] = 1500.0f;    // Used AI to find this compiler flag because I was getting problems
-            bool isQuiet = false;
-            std::vector<std::string> blockedUsers;
-            bool inBlockedSection = false;
-            bool inUserSection = false;
-
-            while (std::getline(file, line)) {
-                if (line == "USER_BEGIN") {
-                    inUserSection = true;
-                    username = password = info = "";
-                    wins = losses = 0;
-                    rating = 1500.0f;
-                    isQuiet = false;
-                    blockedUsers.clear();
-                    continue;
-                }
-                else if (line == "USER_END") {
-                    if (inUserSection) {
-                        // Create user
-                        auto user = std::make_shared<User>(username, password, -1);
-                        user->setInfo(info);
-
-                        // Set wins and losses
-                        for (int i = 0; i < wins; i++) {
-                            user->addWin();
-                        }
-                        for (int i = 0; i < losses; i++) {
-                            user->addLoss();
-                        }
-
-                        user->setQuietMode(isQuiet);
-
-                        // Add blocked users
-                        for (const auto& blockedUser : blockedUsers) {
-                            user->blockUser(blockedUser);
-                        }
-
-                        users[username] = user;
-                        std::cout << "Loaded user: " << username << std::endl;
-                    }
-                    inUserSection = false;
-                    continue;
+            else if (line == "USER_END") {
+                if (inUserSection && !user.username.empty()) {
+                    entries.push_back(std::move(user));
                 }
+                inUserSection = false;
+                continue;
+            }
 
-                if (inUserSection) {
-                    if (line == "blocked_begin") {
-                        inBlockedSection = true;
-                        continue;
-                    }
-                    else if (line == "blocked_end") {
-                        inBlockedSection = false;
-                        continue;
-                    }
-
-                    if (inBlockedSection) {
-                        blockedUsers.push_back(line);
-                    }
-                    else {
-                        size_t equalPos = line.find('=');
-                        if (equalPos != std::string::npos) {
-                            std::string key = line.substr(0, equalPos);
-                            std::string value = line.substr(equalPos + 1);
-
-                            if (key == "username") username = value;
-                            else if (key == "password") password = value;
-                            else if (key == "info") info = value;
-                            else if (key == "wins") {
-                                try { wins = std::stoi(value); }
-                                catch (...) { wins = 0; }
-                            }
-                            else if (key == "losses") {
-                                try { losses = std::stoi(value); }
-                                catch (...) { losses = 0; }
-                            }
-                            else if (key == "rating") {
-                                try { rating = std::stof(value); }
-                                catch (...) { rating = 1500.0f; }
-                            }
-                            else if (key == "quiet") isQuiet = (value == "1");
-                        }
-                    }
+            if (!inUserSection) {
+                continue;
+            }
+            if (line == "blocked_begin") {
+                inBlockedSection = true;
+            }
+            else if (line == "blocked_end") {
+                inBlockedSection = false;
+            }
+            else if (inBlockedSection) {
+                user.blocked.emplace_back(line);
+            }
+            else {
+                size_t equalPos = line.find('=');
+                if (equalPos == std::string_view::npos) {
+                    continue;
                 }
+                std::string_view key = line.substr(0, equalPos);
+                std::string_view value = line.substr(equalPos + 1);
+
+                if (key == "username") user.username.assign(value);
+                else if (key == "password") user.password.assign(value);
+                else if (key == "info") user.info.assign(value);
+                else if (key == "wins") TextImport::parseNumber(value, user.wins);
+                else if (key == "losses") TextImport::parseNumber(value, user.losses);
+                else if (key == "rating") TextImport::parseNumber(value, user.rating);
+                else if (key == "quiet") user.quiet = (value == "1");
             }
-
-            file.close();
-            std::cout << "Loaded " << (users.size() - 1) << " user accounts from save." << std::endl;
-        }
-        catch (const std::exception& e) {
-            std::cerr << "Error loading users: " << e.what() << std::endl;
         }
     }
 
     bool updateUserInfo(const std::string& username, const std::string& info) {
-        auto user = getUserByUsername(username);
-        if (!user) {
-            return false;
-        }
-
-        user->setInfo(info);
-        saveUsers(); // Save after updating info
-        return true;
+        return changeUser(username, {"info", username, info}, [&](User& user) { user.setInfo(info); });
     }
 
     bool changePassword(const std::string& username, const std::string& newPassword) {
-        auto user = getUserByUsername(username);
-        if (!user) {
-            return false;
-        }
+        return changeUser(username, {"passwd", username, newPassword},
+                          [&](User& user) { user.setPassword(newPassword); });
+    }
+
+    bool setQuietMode(const std::string& username, bool quiet) {
+        return changeUser(username, {"quiet", username, quiet ? "1" : "0"},
+                          [&](User& user) { user.setQuietMode(quiet); });
+    }
 
-        user->setPassword(newPassword);
+    bool setBlocked(const std::string& username, const std::string& target, bool blocked) {
+        UserId targetId = UserIds::getInstance().intern(target);
+        return changeUser(username, {blocked ? "block" : "unblock", username, target}, [&](User& user) {
+            if (blocked) {
+                user.blockUser(targetId);
+            } else {
+                user.unblockUser(targetId);
+            }
+        });
+    }
 
-        saveUsers(); // Save after changing password
-        return true;
+    // Count a finished game for both players
+    void recordGameResult(const std::shared_ptr<User>& winner, const std::shared_ptr<User>& loser) {
+        {
+            std::lock_guard<std::mutex> lock(changesMutex);
+            winner->addWin();
+            loser->addLoss();
+            changedUsers.insert(winner);
+            changedUsers.insert(loser);
+            logStats(winner);
+            logStats(loser);
+        }
     }
 
     std::string getOnlineUsersList() {
-        std::lock_guard<std::mutex> lock(usersMutex);
+        auto online = socketToUser.snapshot();
 
         // regular users
         std::vector<std::shared_ptr<User>> onlineRegularUsers;
-        for (const auto& pair : socketToUser) {
-            std::string username = pair.second;
-            if (username != "guest" && users.find(username) != users.end()) {
-                onlineRegularUsers.push_back(users[username]);
+        for (const auto& pair : online) {
+            if (pair.second->getId() != guestId) {
+                onlineRegularUsers.push_back(pair.second);
             }
         }
 
         // guests
         int guestCount = 0;
-        for (const auto& pair : socketToUser) {
-            if (pair.second == "guest") {
+        for (const auto& pair : online) {
+            if (pair.second->getId() == guestId) {
                 guestCount++;
             }
         }
@@ -486,6 +693,11 @@ public:
 
         return result;
     }
+
+    // How the user and socket maps' stripes were used, for the shutdown log
+    std::string getLockStats() const {
+        return "users: " + users.summary() + "\nsockets: " + socketToUser.summary();
+    }
 };
 
 #endif // USER_H
\ No newline at end of file
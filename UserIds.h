@@ -0,0 +1,81 @@
+#ifndef USERIDS_H
+#define USERIDS_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Usernames interned to small dense numbers, so the structures that refer to users
+// (mailboxes, block lists, sockets, games) hash and compare an int instead of a
+// string. An id is handed out the first time a name is seen in this process and is
+// not saved; the files keep names, which are looked up again only for output.
+using UserId = uint32_t;
+
+class UserIds
+{
+public:
+    static const UserId NONE = UINT32_MAX;
+
+    static UserIds& getInstance()
+    {
+        static UserIds instance;
+        return instance;
+    }
+
+    // The id of name, assigned if it has none yet
+    UserId intern(const std::string& name)
+    {
+        UserId id = find(name);
+        if (id != NONE)
+        {
+            return id;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto known = ids.find(name);
+        if (known != ids.end())
+        {
+            return known->second;
+        }
+        id = static_cast<UserId>(names.size());
+        names.push_back(name);
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    // NONE if name was never interned
+    UserId find(const std::string& name) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto known = ids.find(name);
+        return known == ids.end() ? NONE : known->second;
+    }
+
+    std::string name(UserId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return id < names.size() ? names[id] : std::string();
+    }
+
+    // Append the names of the ids known doesn't have yet, so known[id] is the name of
+    // every id handed out so far
+    void namesSince(std::vector<std::string>& known) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        known.insert(known.end(), names.begin() + static_cast<long>(known.size()), names.end());
+    }
+
+private:
+    UserIds() {}
+
+    mutable std::shared_mutex mutex;
+    std::deque<std::string> names;  // by id; a deque so the views in ids stay valid
+    std::unordered_map<std::string_view, UserId> ids;
+};
+
+#endif //USERIDS_H
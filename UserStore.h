@@ -0,0 +1,551 @@
+#ifndef USERSTORE_H
+#define USERSTORE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Binary snapshot of all registered users, read through a read-only mmap so opening
+// it costs the same for ten accounts as for a million. Users are only decoded when
+// they are looked up. A checkpoint only writes the users that changed (see update()),
+// the file is rebuilt when it runs out of spare records or its heap is mostly dead.
+//
+// Layout (native byte order):
+//   Header                   magic, version, snapshot lsn, counts and section offsets
+//   Record[capacity]         fixed width, strings are offset/length into the heap; the
+//                            first recordCount are in use, the rest are spare
+//   uint32_t[bucketCount]    open-addressing hash index on username, record index + 1
+//                            (0 = empty), bucketCount a power of two
+//   heap                     the strings, up to the end of the file; blocked users are
+//                            stored '\n'-separated. Strings replaced by an update stay
+//                            behind as dead bytes.
+class UserStore
+{
+public:
+    static const uint32_t MAGIC = 0x554b4d47;  // "GMKU"
+    static const uint32_t VERSION = 2;  // version 1 files have no spare records and are read the same
+
+    // One user as written to the file
+    struct Entry
+    {
+        std::string username;
+        std::string password;
+        std::string info;
+        int wins;
+        int losses;
+        float rating;
+        bool quiet;
+        std::vector<std::string> blocked;
+    };
+
+    UserStore() : base(nullptr), length(0), header(nullptr), records(nullptr), buckets(nullptr), heap(nullptr) {}
+
+    ~UserStore()
+    {
+        unmap();
+    }
+
+    UserStore(const UserStore&) = delete;
+    UserStore& operator=(const UserStore&) = delete;
+
+    // Map a store file. Returns false if it is missing or not a valid store, the
+    // store then keeps what it had mapped before.
+    bool open(const std::string& path)
+    {
+        UserStore fresh;
+        if (!fresh.map(path))
+        {
+            return false;
+        }
+        std::swap(base, fresh.base);
+        std::swap(length, fresh.length);
+        std::swap(header, fresh.header);
+        std::swap(records, fresh.records);
+        std::swap(buckets, fresh.buckets);
+        std::swap(heap, fresh.heap);
+        this->path.swap(fresh.path);
+        return true;
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    uint32_t size() const { return header ? header->recordCount : 0; }
+    uint64_t getLsn() const { return header ? header->lsn : 0; }
+
+    // Index of the record for username, -1 if there is none
+    long find(const std::string& username) const
+    {
+        if (!header || header->bucketCount == 0)
+        {
+            return -1;
+        }
+
+        // Probing stops at an empty bucket; the bound only matters for a damaged file
+        uint32_t mask = header->bucketCount - 1;
+        uint32_t slot = hashName(username) & mask;
+        for (uint32_t probes = 0; probes < header->bucketCount; probes++, slot = (slot + 1) & mask)
+        {
+            // Past recordCount is a user an unfinished update() was adding
+            uint32_t entry = buckets[slot];
+            if (entry == 0 || entry > header->recordCount || !intact(records[entry - 1]))
+            {
+                return -1;
+            }
+            const Record& record = records[entry - 1];
+            if (record.usernameLength == username.size() &&
+                memcmp(heap + record.usernameOffset, username.data(), username.size()) == 0)
+            {
+                return static_cast<long>(entry - 1);
+            }
+        }
+        return -1;
+    }
+
+    // Decode record index, false if it is damaged
+    bool entry(uint32_t index, Entry& result) const
+    {
+        if (!header || index >= header->recordCount || !intact(records[index]))
+        {
+            return false;
+        }
+
+        const Record& record = records[index];
+        result.blocked.clear();
+        result.username.assign(heap + record.usernameOffset, record.usernameLength);
+        result.password.assign(heap + record.passwordOffset, record.passwordLength);
+        result.info.assign(heap + record.infoOffset, record.infoLength);
+        result.wins = record.wins;
+        result.losses = record.losses;
+        result.rating = record.rating;
+        result.quiet = (record.flags & FLAG_QUIET) != 0;
+
+        const char* blocked = heap + record.blockedOffset;
+        const char* end = blocked + record.blockedLength;
+        while (blocked < end)
+        {
+            const char* newline = static_cast<const char*>(memchr(blocked, '\n', static_cast<size_t>(end - blocked)));
+            if (!newline)
+            {
+                newline = end;
+            }
+            result.blocked.emplace_back(blocked, newline);
+            blocked = newline + 1;
+        }
+        return true;
+    }
+
+    // Lay out a store file for entries, usernames must be unique. A quarter more
+    // records than needed are left spare for users registered later.
+    static std::string build(uint64_t lsn, const std::vector<Entry>& entries)
+    {
+        size_t capacity = entries.size() + entries.size() / 4 + 16;
+        uint32_t bucketCount = 16;
+        while (bucketCount < capacity * 2)
+        {
+            bucketCount *= 2;
+        }
+
+        std::vector<Record> recordTable(capacity);
+        memset(recordTable.data(), 0, recordTable.size() * sizeof(Record));
+        std::vector<uint32_t> bucketTable(bucketCount, 0);
+        std::string heapData;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const Entry& user = entries[i];
+            Record& record = recordTable[i];
+            putString(heapData, user.username, record.usernameOffset, record.usernameLength);
+            putString(heapData, user.password, record.passwordOffset, record.passwordLength);
+            putString(heapData, user.info, record.infoOffset, record.infoLength);
+            putString(heapData, joinBlocked(user.blocked), record.blockedOffset, record.blockedLength);
+            setFields(record, user);
+
+            uint32_t slot = hashName(user.username) & (bucketCount - 1);
+            while (bucketTable[slot] != 0)
+            {
+                slot = (slot + 1) & (bucketCount - 1);
+            }
+            bucketTable[slot] = static_cast<uint32_t>(i + 1);
+        }
+
+        Header fileHeader;
+        memset(&fileHeader, 0, sizeof(fileHeader));
+        fileHeader.magic = MAGIC;
+        fileHeader.version = VERSION;
+        fileHeader.lsn = lsn;
+        fileHeader.recordCount = static_cast<uint32_t>(entries.size());
+        fileHeader.bucketCount = bucketCount;
+        fileHeader.recordsOffset = sizeof(Header);
+        fileHeader.bucketsOffset = fileHeader.recordsOffset + recordTable.size() * sizeof(Record);
+        fileHeader.heapOffset = fileHeader.bucketsOffset + bucketTable.size() * sizeof(uint32_t);
+        fileHeader.liveBytes = heapData.size();
+
+        std::string file;
+        file.reserve(fileHeader.heapOffset + heapData.size());
+        file.append(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+        file.append(reinterpret_cast<const char*>(recordTable.data()), recordTable.size() * sizeof(Record));
+        file.append(reinterpret_cast<const char*>(bucketTable.data()), bucketTable.size() * sizeof(uint32_t));
+        file += heapData;
+        return file;
+    }
+
+    // Write changed users into the file in place. Their new strings are appended to
+    // the heap and their records overwritten; new users take spare records. The header
+    // with the new lsn is written only once the rest is durable, so after a crash in
+    // between the old lsn stays and the log replays every change again. readMutex, which
+    // readers of the store hold shared, is taken exclusively only while the mapping
+    // and records change. written gets the bytes written.
+    //
+    // Returns false if the file can't be written, has no spare records left or would
+    // be mostly dead bytes; build a new one then.
+    bool update(uint64_t lsn, const std::vector<Entry>& changed, std::shared_mutex& readMutex, size_t& written)
+    {
+        written = 0;
+        if (!header)
+        {
+            return false;
+        }
+
+        // Lay out the new records and the strings to append. Strings that didn't change
+        // keep their place, and the appended ones are synced before any record points at
+        // them, so a record that reached the disk never refers to missing strings. Only a
+        // record whose own write is cut short by a crash can still fail its check.
+        uint64_t heapEnd = heapBytes();
+        uint64_t liveBytes = header->liveBytes;
+        uint32_t recordCount = header->recordCount;
+        std::string appended;
+        std::vector<Record> newRecords(changed.size());
+        std::vector<uint32_t> indexes(changed.size());
+        for (size_t i = 0; i < changed.size(); i++)
+        {
+            const Entry& user = changed[i];
+            Record& record = newRecords[i];
+            long found = find(user.username);
+            if (found >= 0)
+            {
+                record = records[found];
+                indexes[i] = static_cast<uint32_t>(found);
+            }
+            else
+            {
+                if (recordCount == capacity())
+                {
+                    return false;
+                }
+                memset(&record, 0, sizeof(record));
+                indexes[i] = recordCount++;
+                placeString(user.username, found >= 0, record.usernameOffset, record.usernameLength, heapEnd, appended,
+                            liveBytes);
+            }
+            placeString(user.password, found >= 0, record.passwordOffset, record.passwordLength, heapEnd, appended,
+                        liveBytes);
+            placeString(user.info, found >= 0, record.infoOffset, record.infoLength, heapEnd, appended, liveBytes);
+            placeString(joinBlocked(user.blocked), found >= 0, record.blockedOffset, record.blockedLength, heapEnd,
+                        appended, liveBytes);
+            setFields(record, user);
+        }
+        if (heapEnd + appended.size() > UINT32_MAX || heapEnd + appended.size() > 2 * liveBytes + DEAD_SLACK_BYTES)
+        {
+            return false;
+        }
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            perror(("open " + path).c_str());
+            return false;
+        }
+        // On disk before the records that point at them: one shared fdatasync could
+        // let a record reach the disk without its strings, losing the whole account
+        bool ok = writeAt(fd, appended.data(), appended.size(), length);
+        ok = ok && (appended.empty() || fdatasync(fd) == 0);
+
+        if (ok)
+        {
+            std::lock_guard<std::shared_mutex> lock(readMutex);
+
+            // Map the appended strings before any record points at them
+            ok = open(path);
+            for (size_t i = 0; ok && i < changed.size(); i++)
+            {
+                uint64_t offset = header->recordsOffset + uint64_t(indexes[i]) * sizeof(Record);
+                ok = writeAt(fd, &newRecords[i], sizeof(Record), offset);
+                if (ok && indexes[i] >= header->recordCount)
+                {
+                    ok = addToIndex(fd, changed[i].username, indexes[i], recordCount);
+                    written += sizeof(uint32_t);
+                }
+                written += sizeof(Record);
+            }
+        }
+        ok = ok && fdatasync(fd) == 0;
+
+        if (ok)
+        {
+            std::lock_guard<std::shared_mutex> lock(readMutex);
+            Header updated = *header;
+            updated.lsn = lsn;
+            updated.recordCount = recordCount;
+            updated.liveBytes = liveBytes;
+            ok = writeAt(fd, &updated, sizeof(updated), 0);
+        }
+        ok = ok && fdatasync(fd) == 0;
+        if (!ok)
+        {
+            perror(("update " + path).c_str());
+        }
+        close(fd);
+
+        written += appended.size() + sizeof(Header);
+        return ok;
+    }
+
+private:
+    static const uint32_t FLAG_QUIET = 1;
+    static const uint64_t DEAD_SLACK_BYTES = 1024 * 1024;  // dead heap bytes always tolerated
+
+    bool map(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != ENOENT)
+            {
+                perror(("open " + path).c_str());
+            }
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(Header))
+        {
+            std::fprintf(stderr, "%s: too short to be a user store\n", path.c_str());
+            close(fd);
+            return false;
+        }
+
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            perror(("mmap " + path).c_str());
+            return false;
+        }
+        base = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+
+        if (!validate())
+        {
+            std::fprintf(stderr, "%s: not a version %u user store\n", path.c_str(), VERSION);
+            unmap();
+            return false;
+        }
+        this->path = path;
+        return true;
+    }
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t lsn;  // last log record the snapshot includes
+        uint32_t recordCount;
+        uint32_t bucketCount;
+        uint64_t recordsOffset;
+        uint64_t bucketsOffset;
+        uint64_t heapOffset;
+        uint64_t liveBytes;  // heap bytes records still point at
+    };
+
+    struct Record
+    {
+        uint32_t usernameOffset, usernameLength;
+        uint32_t passwordOffset, passwordLength;
+        uint32_t infoOffset, infoLength;
+        uint32_t blockedOffset, blockedLength;
+        int32_t wins;
+        int32_t losses;
+        float rating;
+        uint32_t flags;
+    };
+
+    // FNV-1a
+    static uint32_t hashName(const std::string& name)
+    {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : name)
+        {
+            hash = (hash ^ c) * 16777619u;
+        }
+        return hash;
+    }
+
+    static void putString(std::string& heapData, const std::string& value, uint32_t& offset, uint32_t& size)
+    {
+        offset = static_cast<uint32_t>(heapData.size());
+        size = static_cast<uint32_t>(value.size());
+        heapData += value;
+    }
+
+    // Point a field of an updated record at value: where it already is if it is
+    // unchanged, else at a copy appended after heapEnd
+    void placeString(const std::string& value, bool existing, uint32_t& offset, uint32_t& size, uint64_t heapEnd,
+                     std::string& appended, uint64_t& liveBytes) const
+    {
+        if (existing)
+        {
+            if (size == value.size() && memcmp(heap + offset, value.data(), size) == 0)
+            {
+                return;
+            }
+            liveBytes -= size;
+        }
+        offset = static_cast<uint32_t>(heapEnd + appended.size());
+        size = static_cast<uint32_t>(value.size());
+        appended += value;
+        liveBytes += value.size();
+    }
+
+    static std::string joinBlocked(const std::vector<std::string>& blocked)
+    {
+        std::string joined;
+        for (const auto& name : blocked)
+        {
+            if (!joined.empty())
+            {
+                joined += '\n';
+            }
+            joined += name;
+        }
+        return joined;
+    }
+
+    static void setFields(Record& record, const Entry& user)
+    {
+        record.wins = user.wins;
+        record.losses = user.losses;
+        record.rating = user.rating;
+        record.flags = user.quiet ? FLAG_QUIET : 0;
+    }
+
+    // Take the first free bucket for a new record, recordCount being the count once the
+    // update is done. Buckets pointing past it are left over from an update that didn't
+    // finish and count as free.
+    bool addToIndex(int fd, const std::string& username, uint32_t index, uint32_t recordCount)
+    {
+        uint32_t mask = header->bucketCount - 1;
+        uint32_t slot = hashName(username) & mask;
+        while (buckets[slot] != 0 && buckets[slot] <= recordCount)
+        {
+            slot = (slot + 1) & mask;
+        }
+        uint32_t entry = index + 1;
+        return writeAt(fd, &entry, sizeof(entry), header->bucketsOffset + uint64_t(slot) * sizeof(uint32_t));
+    }
+
+    static bool writeAt(int fd, const void* data, size_t size, uint64_t offset)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            ssize_t n = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            bytes += n;
+            size -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+
+    uint32_t capacity() const
+    {
+        return static_cast<uint32_t>((header->bucketsOffset - header->recordsOffset) / sizeof(Record));
+    }
+
+    // The heap runs to the end of the mapping
+    uint64_t heapBytes() const
+    {
+        return length - header->heapOffset;
+    }
+
+    // Check the header and that the sections fit the file. Records are only checked
+    // when they are read, so opening doesn't touch the rest of the file.
+    bool validate()
+    {
+        const Header* candidate = reinterpret_cast<const Header*>(base);
+        if (candidate->magic != MAGIC || (candidate->version != VERSION && candidate->version != 1))
+        {
+            return false;
+        }
+
+        uint32_t bucketCount = candidate->bucketCount;
+        uint64_t recordBytes = candidate->bucketsOffset - candidate->recordsOffset;
+        if (bucketCount == 0 || (bucketCount & (bucketCount - 1)) != 0 || candidate->recordsOffset != sizeof(Header) ||
+            candidate->bucketsOffset < candidate->recordsOffset + uint64_t(candidate->recordCount) * sizeof(Record) ||
+            recordBytes % sizeof(Record) != 0 || bucketCount <= recordBytes / sizeof(Record) ||
+            candidate->heapOffset != candidate->bucketsOffset + uint64_t(bucketCount) * sizeof(uint32_t) ||
+            candidate->heapOffset + candidate->liveBytes > length)
+        {
+            return false;
+        }
+
+        header = candidate;
+        records = reinterpret_cast<const Record*>(base + header->recordsOffset);
+        buckets = reinterpret_cast<const uint32_t*>(base + header->bucketsOffset);
+        heap = base + header->heapOffset;
+        return true;
+    }
+
+    // Every string of the record lies inside the heap
+    bool intact(const Record& record) const
+    {
+        return inHeap(record.usernameOffset, record.usernameLength) &&
+               inHeap(record.passwordOffset, record.passwordLength) &&
+               inHeap(record.infoOffset, record.infoLength) &&
+               inHeap(record.blockedOffset, record.blockedLength);
+    }
+
+    bool inHeap(uint32_t offset, uint32_t size) const
+    {
+        return uint64_t(offset) + size <= heapBytes();
+    }
+
+    void unmap()
+    {
+        if (base)
+        {
+            munmap(const_cast<char*>(base), length);
+        }
+        base = nullptr;
+        length = 0;
+        header = nullptr;
+        records = nullptr;
+        buckets = nullptr;
+        heap = nullptr;
+    }
+
+    const char* base;
+    size_t length;
+    const Header* header;
+    const Record* records;
+    const uint32_t* buckets;
+    const char* heap;
+    std::string path;
+};
+
+#endif //USERSTORE_H
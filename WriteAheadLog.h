@@ -0,0 +1,639 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Append-only log of changes to a data file. Every change is one record, so saving
+// it costs the size of the record instead of a rewrite of the whole file. A full
+// snapshot of the data is written now and then, after which the records it covers
+// are dropped from the log.
+//
+// On disk each record is [payload length][crc32 of payload][payload], the payload
+// being the record's sequence number (lsn) followed by its fields, each with its own
+// length. A record cut short by a crash fails its length or checksum and is dropped
+// along with anything after it.
+//
+// Records are written by a thread of the log's own (group commit): whatever was
+// appended while it was busy goes out in one write and one fdatasync. How long a
+// record may wait for that is set by the durability mode:
+//   NONE      written without fdatasync, changes are acknowledged right away
+//   BATCH     records gather for up to the commit window, then share one fdatasync
+//   EVERY_OP  one write and fdatasync per record, as soon as it is appended
+class WriteAheadLog
+{
+public:
+    typedef std::vector<std::string> Record;
+    typedef std::function<void(uint64_t lsn, const Record& record)> ReplayCallback;
+
+    enum Durability { NONE, BATCH, EVERY_OP };
+
+    static constexpr int DEFAULT_COMMIT_WINDOW_MS = 5;
+
+    explicit WriteAheadLog(const std::string& path)
+        : path(path), fd(-1), logBytes(0), torn(false), nextLsn(1), durableLsn(0), pendingBytes(0), durability(BATCH),
+          commitWindow(std::chrono::milliseconds(DEFAULT_COMMIT_WINDOW_MS)), stopping(false), commits(0),
+          committedRecords(0), largestBatch(0), totalLatencyUs(0), maxLatencyUs(0) {}
+
+    ~WriteAheadLog()
+    {
+        // Whatever is still pending is written before the writer exits
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        if (writer.joinable())
+        {
+            writer.join();
+        }
+        printStats();
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Replay the records newer than the snapshot (lsn > afterLsn), then open the log
+    // for appending
+    bool open(uint64_t afterLsn, const ReplayCallback& replay)
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+
+        std::string data;
+        if (!readFile(path, data))
+        {
+            return false;
+        }
+
+        uint64_t lastLsn = afterLsn;
+        size_t replayed = 0;
+        size_t intact = parse(data, [&](uint64_t lsn, const Record& record, size_t, size_t) {
+            if (lsn > afterLsn)
+            {
+                replay(lsn, record);
+                replayed++;
+            }
+            if (lsn > lastLsn)
+            {
+                lastLsn = lsn;
+            }
+        });
+
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            perror(("open " + path).c_str());
+            return false;
+        }
+
+        // Cut off a torn tail so new records don't land behind it
+        if (intact < data.size())
+        {
+            std::cerr << path << ": dropped " << (data.size() - intact) << " bytes of incomplete records" << std::endl;
+            if (ftruncate(fd, static_cast<off_t>(intact)) < 0)
+            {
+                perror(("ftruncate " + path).c_str());
+            }
+        }
+
+        logBytes = intact;
+        {
+            std::lock_guard<std::mutex> queueLock(queueMutex);
+            nextLsn = lastLsn + 1;
+            durableLsn = lastLsn;
+            writer = std::thread(&WriteAheadLog::writerLoop, this);
+        }
+        if (replayed > 0)
+        {
+            std::cout << "Replayed " << replayed << " records from " << path << std::endl;
+        }
+        return true;
+    }
+
+    // Called on the writer thread before each commit, with whether it will be synced.
+    // For data kept in other files that the records refer to; set before open(). A
+    // hook that returns false fails the commit, which is then retried like a failed write.
+    void setBeforeCommit(std::function<bool(bool syncing)> hook)
+    {
+        beforeCommit = std::move(hook);
+    }
+
+    // Takes effect from the next commit
+    void setDurability(Durability mode, int commitWindowMs)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        durability = mode;
+        commitWindow = std::chrono::milliseconds(commitWindowMs);
+    }
+
+    static bool parseDurability(const std::string& name, Durability& mode)
+    {
+        if (name == "none")
+        {
+            mode = NONE;
+        }
+        else if (name == "batch")
+        {
+            mode = BATCH;
+        }
+        else if (name == "every-op")
+        {
+            mode = EVERY_OP;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    // Queue one record for the writer and return its lsn, 0 if the log isn't open.
+    // Call it while holding the lock that protects the data, so the log has changes
+    // in the order they were made.
+    uint64_t append(const Record& record)
+    {
+        std::string frame = encode(0, record);
+        bool wake;
+        uint64_t lsn;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (!writer.joinable())
+            {
+                return 0;
+            }
+
+            lsn = nextLsn++;
+            memcpy(&frame[HEADER_BYTES], &lsn, sizeof(lsn));
+            putChecksum(frame);
+
+            // A batch waits out its window unless it grows past MAX_BATCH_BYTES
+            wake = pending.empty() || durability != BATCH ||
+                   (pendingBytes < MAX_BATCH_BYTES && pendingBytes + frame.size() >= MAX_BATCH_BYTES);
+            pendingBytes += frame.size();
+            pending.push_back(PendingRecord{lsn, std::move(frame), std::chrono::steady_clock::now()});
+        }
+        if (wake)
+        {
+            queueReady.notify_one();
+        }
+        return lsn;
+    }
+
+    // Run done once record lsn is as durable as the mode promises: at once with NONE,
+    // otherwise on the writer thread after the fdatasync that covers it. Callbacks
+    // run in lsn order and must not block.
+    void whenDurable(uint64_t lsn, std::function<void()> done)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (durability != NONE && lsn > durableLsn)
+            {
+                waiters.emplace(lsn, std::move(done));
+                return;
+            }
+        }
+        done();
+    }
+
+    // Sequence number of the newest record, what a snapshot taken now covers
+    uint64_t lastLsn()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return nextLsn - 1;
+    }
+
+    // Bytes on disk plus bytes waiting for the writer
+    size_t size()
+    {
+        size_t queued;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queued = pendingBytes;
+        }
+        std::lock_guard<std::mutex> lock(fileMutex);
+        return logBytes + queued;
+    }
+
+    // Drop the records a snapshot now covers (lsn <= coveredLsn). Only the records
+    // after them are copied, so this costs what was logged since the snapshot began.
+    // Records still pending land in the new file.
+    bool truncateThrough(uint64_t coveredLsn)
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+
+        std::string data;
+        if (!readFile(path, data))
+        {
+            return false;
+        }
+
+        size_t keepFrom = data.size();
+        parse(data, [&](uint64_t lsn, const Record&, size_t start, size_t) {
+            if (lsn > coveredLsn && start < keepFrom)
+            {
+                keepFrom = start;
+            }
+        });
+
+        std::string tail = data.substr(keepFrom);
+        if (!replaceFile(path, tail))
+        {
+            return false;
+        }
+
+        int newFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (newFd < 0)
+        {
+            perror(("open " + path).c_str());
+            return false;
+        }
+        close(fd);
+        fd = newFd;
+        logBytes = tail.size();
+        torn = false;
+        return true;
+    }
+
+    // Write a whole file so that a crash leaves either the old or the new version
+    static bool replaceFile(const std::string& target, const std::string& contents)
+    {
+        std::string temp = target + ".tmp";
+        int tempFd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (tempFd < 0)
+        {
+            perror(("open " + temp).c_str());
+            return false;
+        }
+
+        bool ok = writeAll(tempFd, contents) && fsync(tempFd) == 0;
+        if (!ok)
+        {
+            perror(("write " + temp).c_str());
+        }
+        close(tempFd);
+
+        if (ok && rename(temp.c_str(), target.c_str()) < 0)
+        {
+            perror(("rename " + temp).c_str());
+            ok = false;
+        }
+        return ok;
+    }
+
+private:
+    static const size_t HEADER_BYTES = 8;
+    static const size_t MAX_BATCH_BYTES = 1024 * 1024;  // commit early past this much
+    static constexpr int RETRY_MIN_MS = 10;  // first wait before writing a failed batch again
+    static constexpr int RETRY_MAX_MS = 1000;
+
+    struct PendingRecord
+    {
+        uint64_t lsn;
+        std::string frame;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    // Take what is pending, write it with one write() and, unless the mode is NONE,
+    // make it durable with one fdatasync, then acknowledge it
+    void writerLoop()
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        while (true)
+        {
+            queueReady.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty())
+            {
+                break;
+            }
+
+            // Let a batch fill up for the rest of the window of its oldest record
+            if (durability == BATCH && !stopping)
+            {
+                queueReady.wait_until(lock, pending.front().queued + commitWindow, [this]() {
+                    return stopping || pendingBytes >= MAX_BATCH_BYTES || durability != BATCH;
+                });
+            }
+
+            size_t take = durability == EVERY_OP ? 1 : pending.size();
+            bool syncing = durability != NONE;
+            std::string batch;
+            for (size_t i = 0; i < take; i++)
+            {
+                batch += pending[i].frame;
+            }
+            uint64_t batchLsn = pending[take - 1].lsn;
+            std::chrono::steady_clock::time_point oldest = pending.front().queued;
+            pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(take));
+            pendingBytes -= batch.size();
+            lock.unlock();
+
+            // Nothing is acknowledged until it is really on disk: a failed batch is
+            // written again until it goes through. Records after it would replay
+            // without it, so if the log is closed first the writer stops there.
+            bool committed = prepareAndCommit(batch, syncing);
+            for (int delayMs = RETRY_MIN_MS; !committed; delayMs = std::min(delayMs * 2, RETRY_MAX_MS))
+            {
+                lock.lock();
+                if (stopping)
+                {
+                    std::cerr << path << ": giving up, " << (take + pending.size())
+                              << " records not written, acknowledged records are intact" << std::endl;
+                    return;
+                }
+                queueReady.wait_for(lock, std::chrono::milliseconds(delayMs), [this]() { return stopping; });
+                lock.unlock();
+                committed = prepareAndCommit(batch, syncing);
+            }
+            long long latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - oldest).count();
+
+            // Acknowledge in lsn order without holding the lock
+            std::vector<std::function<void()>> done;
+            lock.lock();
+            durableLsn = batchLsn;
+            commits++;
+            committedRecords += take;
+            largestBatch = std::max(largestBatch, take);
+            totalLatencyUs += latencyUs;
+            maxLatencyUs = std::max(maxLatencyUs, latencyUs);
+            while (!waiters.empty() && waiters.begin()->first <= durableLsn)
+            {
+                done.push_back(std::move(waiters.begin()->second));
+                waiters.erase(waiters.begin());
+            }
+            lock.unlock();
+            for (auto& callback : done)
+            {
+                callback();
+            }
+            lock.lock();
+        }
+    }
+
+    bool prepareAndCommit(const std::string& batch, bool syncing)
+    {
+        return (!beforeCommit || beforeCommit(syncing)) && commit(batch, syncing);
+    }
+
+    // Append batch and, if syncing, fdatasync it. On failure the file is cut back to
+    // where the batch began, so the retry doesn't land behind a torn record; after a
+    // failed fdatasync the written pages can't be trusted, so they are rewritten too.
+    bool commit(const std::string& batch, bool syncing)
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        if (fd < 0)
+        {
+            return false;
+        }
+        if (torn)
+        {
+            if (ftruncate(fd, static_cast<off_t>(logBytes)) < 0)
+            {
+                perror(("ftruncate " + path).c_str());
+                return false;
+            }
+            torn = false;
+        }
+
+        if (!writeAll(fd, batch))
+        {
+            perror(("write " + path).c_str());
+            cutBack();
+            return false;
+        }
+        if (syncing && fdatasync(fd) < 0)
+        {
+            perror(("fdatasync " + path).c_str());
+            cutBack();
+            return false;
+        }
+        logBytes += batch.size();
+        return true;
+    }
+
+    // fileMutex held: drop whatever a failed commit left after logBytes
+    void cutBack()
+    {
+        if (ftruncate(fd, static_cast<off_t>(logBytes)) < 0)
+        {
+            perror(("ftruncate " + path).c_str());
+            torn = true;
+        }
+    }
+
+    void printStats()
+    {
+        if (commits == 0)
+        {
+            return;
+        }
+        std::cout << path << ": " << committedRecords << " records in " << commits << " commits (avg "
+                  << static_cast<double>(committedRecords) / commits << ", max " << largestBatch
+                  << " per commit), commit latency avg " << totalLatencyUs / static_cast<long long>(commits) / 1000.0
+                  << " ms, max " << maxLatencyUs / 1000.0 << " ms" << std::endl;
+    }
+
+    static void putU32(std::string& out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static uint32_t getU32(const std::string& data, size_t offset)
+    {
+        uint32_t value;
+        memcpy(&value, data.data() + offset, sizeof(value));
+        return value;
+    }
+
+    static std::string encode(uint64_t lsn, const Record& record)
+    {
+        std::string payload;
+        payload.append(reinterpret_cast<const char*>(&lsn), sizeof(lsn));
+        putU32(payload, static_cast<uint32_t>(record.size()));
+        for (const auto& field : record)
+        {
+            putU32(payload, static_cast<uint32_t>(field.size()));
+            payload += field;
+        }
+
+        std::string frame;
+        frame.reserve(HEADER_BYTES + payload.size());
+        putU32(frame, static_cast<uint32_t>(payload.size()));
+        putU32(frame, 0);
+        frame += payload;
+        putChecksum(frame);
+        return frame;
+    }
+
+    static void putChecksum(std::string& frame)
+    {
+        uint32_t checksum = static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(frame.data() + HEADER_BYTES),
+                                                        static_cast<uInt>(frame.size() - HEADER_BYTES)));
+        memcpy(&frame[4], &checksum, sizeof(checksum));
+    }
+
+    // Visit each intact record with the byte range of its frame. Returns the length
+    // of the intact prefix of data.
+    static size_t parse(const std::string& data,
+                        const std::function<void(uint64_t, const Record&, size_t, size_t)>& visit)
+    {
+        size_t offset = 0;
+        while (data.size() - offset >= HEADER_BYTES)
+        {
+            uint32_t length = getU32(data, offset);
+            uint32_t checksum = getU32(data, offset + 4);
+            if (length < sizeof(uint64_t) + 4 || data.size() - offset - HEADER_BYTES < length)
+            {
+                break;
+            }
+
+            std::string payload = data.substr(offset + HEADER_BYTES, length);
+            if (crc32(0L, reinterpret_cast<const Bytef*>(payload.data()), static_cast<uInt>(length)) != checksum)
+            {
+                break;
+            }
+
+            uint64_t lsn;
+            memcpy(&lsn, payload.data(), sizeof(lsn));
+            size_t pos = sizeof(lsn);
+            uint32_t count = getU32(payload, pos);
+            pos += 4;
+
+            Record record;
+            bool ok = true;
+            for (uint32_t i = 0; i < count && ok; i++)
+            {
+                if (length - pos < 4)
+                {
+                    ok = false;
+                    break;
+                }
+                uint32_t fieldLength = getU32(payload, pos);
+                pos += 4;
+                if (length - pos < fieldLength)
+                {
+                    ok = false;
+                    break;
+                }
+                record.push_back(payload.substr(pos, fieldLength));
+                pos += fieldLength;
+            }
+            if (!ok)
+            {
+                break;
+            }
+
+            size_t end = offset + HEADER_BYTES + length;
+            visit(lsn, record, offset, end);
+            offset = end;
+        }
+        return offset;
+    }
+
+    // A missing file reads as empty
+    static bool readFile(const std::string& file, std::string& out)
+    {
+        out.clear();
+        int readFd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (readFd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return true;
+            }
+            perror(("open " + file).c_str());
+            return false;
+        }
+
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(readFd, buffer, sizeof(buffer))) != 0)
+        {
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                perror(("read " + file).c_str());
+                close(readFd);
+                return false;
+            }
+            out.append(buffer, static_cast<size_t>(n));
+        }
+        close(readFd);
+        return true;
+    }
+
+    static bool writeAll(int writeFd, const std::string& data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = write(writeFd, data.data() + written, data.size() - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    std::string path;
+
+    // The file, used by the writer and truncateThrough()
+    std::mutex fileMutex;
+    int fd;
+    size_t logBytes;
+    bool torn;  // a failed commit's bytes are still past logBytes
+
+    // Records waiting for the writer and callers waiting for them
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<PendingRecord> pending;
+    uint64_t nextLsn;
+    uint64_t durableLsn;  // newest record the writer has committed
+    size_t pendingBytes;
+    std::multimap<uint64_t, std::function<void()>> waiters;
+    Durability durability;
+    std::chrono::milliseconds commitWindow;
+    bool stopping;
+    std::thread writer;
+    std::function<bool(bool)> beforeCommit;
+
+    // Written by the writer under queueMutex
+    size_t commits;
+    size_t committedRecords;
+    size_t largestBatch;
+    long long totalLatencyUs;
+    long long maxLatencyUs;
+};
+
+#endif //WRITEAHEADLOG_H
@@ -0,0 +1,165 @@
+// Load generator for comparing the server's I/O backends.
+// Opens many guest connections and keeps one command in flight on each,
+// then reports how many responses per second came back.
+//
+//   ./loadgen [--port=N] [--clients=N] [--seconds=N] [--command=who]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LoadClient
+{
+    int sock;
+    std::string pending;  // bytes of the response received so far
+};
+
+static int connectClient(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// Read and discard whatever the server has sent so far
+static void drain(int sock)
+{
+    char buffer[65536];
+    while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+    {
+    }
+}
+
+static bool sendLine(int sock, const std::string& line)
+{
+    std::string data = line + "\r\n";
+    return send(sock, data.c_str(), data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.size());
+}
+
+int main(int argc, char* argv[])
+{
+    int port = 8023;
+    int clientCount = 100;
+    int seconds = 10;
+    std::string command = "who";
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t equalPos = arg.find('=');
+        std::string key = equalPos == std::string::npos ? arg : arg.substr(0, equalPos);
+        std::string value = equalPos == std::string::npos ? "" : arg.substr(equalPos + 1);
+
+        if (key == "--port") port = std::atoi(value.c_str());
+        else if (key == "--clients") clientCount = std::atoi(value.c_str());
+        else if (key == "--seconds") seconds = std::atoi(value.c_str());
+        else if (key == "--command") command = value;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--port=N] [--clients=N] [--seconds=N] [--command=CMD]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Connect and log everyone in as guest before measuring
+    std::vector<LoadClient> clients;
+    for (int i = 0; i < clientCount; i++)
+    {
+        int sock = connectClient(port);
+        if (sock < 0)
+        {
+            return 1;
+        }
+        clients.push_back(LoadClient{sock, ""});
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    for (auto& client : clients)
+    {
+        drain(client.sock);
+        sendLine(client.sock, "guest");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    int epollFd = epoll_create1(0);
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        drain(clients[i].sock);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = static_cast<uint32_t>(i);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[i].sock, &ev);
+        sendLine(clients[i].sock, command);
+    }
+
+    // Every response ends with CRLF; count one and send the next command
+    long responses = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    auto endTime = startTime + std::chrono::seconds(seconds);
+    struct epoll_event events[256];
+    char buffer[65536];
+
+    while (std::chrono::steady_clock::now() < endTime)
+    {
+        int n = epoll_wait(epollFd, events, 256, 100);
+        for (int i = 0; i < n; i++)
+        {
+            LoadClient& client = clients[events[i].data.u32];
+            ssize_t nbytes = recv(client.sock, buffer, sizeof(buffer), 0);
+            if (nbytes <= 0)
+            {
+                std::cerr << "Connection closed by server" << std::endl;
+                return 1;
+            }
+
+            client.pending.append(buffer, nbytes);
+            if (client.pending.size() >= 2 && client.pending.compare(client.pending.size() - 2, 2, "\r\n") == 0)
+            {
+                responses++;
+                client.pending.clear();
+                sendLine(client.sock, command);
+            }
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << clientCount << " clients, command '" << command << "': " << responses << " responses in "
+              << elapsed << "s = " << static_cast<long>(responses / elapsed) << " commands/s" << std::endl;
+
+    for (auto& client : clients)
+    {
+        close(client.sock);
+    }
+    close(epollFd);
+    return 0;
+}
@@ -10,16 +10,24 @@ void signalHandler(int signal)
     shouldExit = 1;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    ServerConfig config;
+    if (!config.parseArgs(argc, argv))
+    {
+        ServerConfig::printUsage(argv[0]);
+        return 1;
+    }
+
     // Set up signal handlers
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
 
-    int port = 8023;
+    // Writes to a client that went away fail with EPIPE instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
 
     TelnetServer server;
-    if (!server.start(port))
+    if (!server.start(config))
     {
         std::cerr << "Failed to start server" << std::endl;
         return 1;